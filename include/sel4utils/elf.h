@@ -18,6 +18,9 @@
 
 #include <vspace/vspace.h>
 
+#include <sel4utils/mapping.h>
+#include <sel4utils/thread.h>
+
 typedef struct sel4utils_elf_region {
     seL4_CapRights rights;
     /* These two vstarts may differ if the elf was not mapped 1to1. Such an elf is not
@@ -27,8 +30,59 @@ typedef struct sel4utils_elf_region {
     uint32_t size;
     reservation_t reservation;
     int cacheable;
+    /* set if the segment is PF_X */
+    int executable;
 } sel4utils_elf_region_t;
 
+/* An elf image loaded once into a loader vspace, whose frames can be shared between many
+ * vspaces with sel4utils_elf_image_share */
+typedef struct sel4utils_elf_image {
+    /* vspace and allocator that own the master copy of the frames */
+    vspace_t *loader;
+    vka_t *vka;
+    void *entry_point;
+    int num_regions;
+    /* regions of the master copy, reservation_vstart is where they are mapped in the loader */
+    sel4utils_elf_region_t *regions;
+    /* set for images in the cache, see sel4utils_elf_image_cache_get */
+    const char *image_name;
+    struct sel4utils_elf_image *next;
+} sel4utils_elf_image_t;
+
+/* most worker threads in a parallel elf loader */
+#define SEL4UTILS_ELF_LOADER_MAX_WORKERS 8
+
+struct sel4utils_elf_loader;
+
+typedef struct sel4utils_elf_loader_worker {
+    struct sel4utils_elf_loader *loader;
+    int index;
+    sel4utils_thread_t thread;
+    /* async endpoint the worker waits on for work */
+    vka_object_t start;
+    /* private range of the loader vspace to map loadee frames in */
+    reservation_t window_reservation;
+    void *window;
+    seL4_CPtr slots[SEL4UTILS_MAP_WINDOW_MAX_PAGES];
+    volatile int done;
+    int error;
+} sel4utils_elf_loader_worker_t;
+
+/* A pool of threads that copy elf segments in parallel, see sel4utils_elf_load_parallel */
+typedef struct sel4utils_elf_loader {
+    vspace_t *vspace;
+    vka_t *vka;
+    seL4_CPtr page_directory;
+    /* async endpoint workers notify when they finish */
+    vka_object_t done;
+    int num_workers;
+    sel4utils_elf_loader_worker_t workers[SEL4UTILS_ELF_LOADER_MAX_WORKERS];
+    /* the load in progress */
+    vspace_t *loadee;
+    vka_t *loadee_vka;
+    void *image;
+} sel4utils_elf_loader_t;
+
 /**
  * Load an elf file into a vspace.
  *
@@ -55,6 +109,90 @@ void *
 sel4utils_elf_load_record_regions(vspace_t *loadee, vspace_t *loader, vka_t *loadee_vka,
                                   vka_t *loader_vka, char *image_name, sel4utils_elf_region_t *regions, int mapanywhere);
 
+/**
+ * Load an elf file into a vspace, leaving pages that only hold zero initialised data (bss) to
+ * be allocated on demand. The regions are reserved lazily (see
+ * sel4utils_reserve_range_at_lazy), so faults on those pages must be handled, eg. by
+ * sel4utils_start_lazy_fault_handler. Loading takes time in proportion to the file size
+ * rather than the memory size of the image.
+ *
+ * @param loadee the sel4utils vspace to load the elf file into
+ * @param loader the vspace we are loading from
+ * @param loadee_vka allocator to use for allocation in the loadee vspace
+ * @param loader_vka allocator to use for loader vspace. Can be the same as loadee_vka.
+ * @param image_name name of the image in the cpio archive to load.
+ * @param regions Array for list of regions to be placed, the reservations must be kept for
+ *                as long as the pages may be faulted in. Assumed to be the correct size as
+ *                reported by a call to sel4utils_elf_num_regions
+ *
+ * @return The entry point of the new process, NULL on error
+ */
+void *
+sel4utils_elf_load_lazy_bss(vspace_t *loadee, vspace_t *loader, vka_t *loadee_vka,
+                            vka_t *loader_vka, char *image_name, sel4utils_elf_region_t *regions);
+
+/**
+ * Reserve the regions of an elf file in a vspace without loading anything. Each page is
+ * filled from the cpio archive when it is first touched (see sel4utils_set_lazy_source), so
+ * faults in the loadee must be handled, eg. by sel4utils_start_lazy_fault_handler running in
+ * the loader vspace. Only the pages a process actually uses are ever allocated and copied.
+ *
+ * @param loadee the sel4utils vspace to reserve the elf file in
+ * @param loader the vspace the fault handler runs in, the cpio archive must be mapped there
+ * @param image_name name of the image in the cpio archive to load.
+ * @param regions Array for list of regions to be placed, the reservations must be kept for
+ *                as long as the pages may be faulted in. Assumed to be the correct size as
+ *                reported by a call to sel4utils_elf_num_regions
+ *
+ * @return The entry point of the new process, NULL on error
+ */
+void *
+sel4utils_elf_load_lazy(vspace_t *loadee, vspace_t *loader, char *image_name,
+                        sel4utils_elf_region_t *regions);
+
+/**
+ * Create a pool of threads for loading elf files in parallel. The threads run in, and copy
+ * through, the loader vspace, which must be a sel4utils vspace. Each has its own window of
+ * the loader vspace with page tables and cslots set up, so copying never allocates.
+ *
+ * @param loader uninitialised loader struct.
+ * @param vka allocator for the threads and their resources.
+ * @param vspace the current vspace, to load from.
+ * @param num_workers number of threads, at most SEL4UTILS_ELF_LOADER_MAX_WORKERS.
+ * @param config configuration for the threads, eg. their priority and scheduling parameters.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int sel4utils_elf_loader_create(sel4utils_elf_loader_t *loader, vka_t *vka, vspace_t *vspace,
+                                int num_workers, sel4utils_thread_config_t config);
+
+/**
+ * Destroy a pool of loader threads. No load may be in progress.
+ *
+ * @param loader loader created by sel4utils_elf_loader_create.
+ */
+void sel4utils_elf_loader_destroy(sel4utils_elf_loader_t *loader);
+
+/**
+ * Load an elf file as sel4utils_elf_load_record_regions does (without mapanywhere), sharing
+ * the copying between the threads of a loader. The frames are allocated and mapped by the
+ * calling thread first, since vspaces and allocators are not thread safe, then each thread
+ * copies its share of every segment. Returns once all the threads are finished.
+ *
+ * @param loader loader created by sel4utils_elf_loader_create.
+ * @param loadee the vspace to load the elf file into
+ * @param loadee_vka allocator to use for allocation in the loadee vspace, its cspace must be
+ *                   the cspace of the loader's threads.
+ * @param image_name name of the image in the cpio archive to load.
+ * @param regions Optional array for list of regions to be placed. Assumed to be the correct
+                  size as reported by a call to sel4utils_elf_num_regions
+ *
+ * @return The entry point of the new process, NULL on error
+ */
+void *sel4utils_elf_load_parallel(sel4utils_elf_loader_t *loader, vspace_t *loadee,
+                                  vka_t *loadee_vka, char *image_name,
+                                  sel4utils_elf_region_t *regions);
+
 /**
  * Wrapper for sel4utils_elf_load_record_regions. Does not record/perform resevations and
  * maps into the correct virtual addresses
@@ -85,6 +223,95 @@ sel4utils_elf_load(vspace_t *loadee, vspace_t *loader, vka_t *loadee_vka,
 void *
 sel4utils_elf_reserve(vspace_t *loadee, char *image_name, sel4utils_elf_region_t *regions);
 
+/**
+ * Load an elf file once into the loader vspace so that it can be shared with
+ * sel4utils_elf_image_share. The segments are placed anywhere in the loader vspace.
+ *
+ * @param loader the vspace to hold the master copy of the image.
+ * @param vka allocator for the master copy.
+ * @param image_name name of the image in the cpio archive to load.
+ * @param image uninitialised image struct to fill in.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int sel4utils_elf_image_load(vspace_t *loader, vka_t *vka, char *image_name,
+                             sel4utils_elf_image_t *image);
+
+/**
+ * Unmap and free the master copy of an image. Any vspaces sharing it must have been
+ * unshared first.
+ *
+ * @param image image loaded by sel4utils_elf_image_load.
+ */
+void sel4utils_elf_image_free(sel4utils_elf_image_t *image);
+
+/**
+ * Map an image into a vspace at its elf addresses without copying it. Read only segments
+ * are mapped straight from the master copy. Writable segments are mapped read only in copy
+ * on write reservations, and write faults on them should be passed to
+ * sel4utils_handle_cow_fault.
+ *
+ * @param image image loaded by sel4utils_elf_image_load.
+ * @param loadee the vspace to map the image into, must be a sel4utils vspace.
+ * @param loadee_vka allocator of the loadee, used for the cslots of the shared frame caps.
+ * @param regions array of image->num_regions regions to record the reservations in.
+ *
+ * @return The entry point of the elf, NULL on error
+ */
+void *sel4utils_elf_image_share(sel4utils_elf_image_t *image, vspace_t *loadee,
+                                vka_t *loadee_vka, sel4utils_elf_region_t *regions);
+
+/**
+ * Load an image into a vspace at its elf addresses, sharing the read only segments. Read only
+ * and executable segments are mapped straight from the master copy, writable segments are
+ * copied from the master copy into new frames.
+ *
+ * @param image image loaded by sel4utils_elf_image_load, in the loader vspace.
+ * @param loadee the vspace to load the image into, must be a sel4utils vspace.
+ * @param loader the vspace we are loading from.
+ * @param loadee_vka allocator to use for allocation in the loadee vspace
+ * @param loader_vka allocator to use for loader vspace. Can be the same as loadee_vka.
+ * @param regions array of image->num_regions regions to record the reservations in.
+ *
+ * @return The entry point of the elf, NULL on error
+ */
+void *sel4utils_elf_load_shared(sel4utils_elf_image_t *image, vspace_t *loadee, vspace_t *loader,
+                                vka_t *loadee_vka, vka_t *loader_vka,
+                                sel4utils_elf_region_t *regions);
+
+/**
+ * Find the image for image_name loaded into loader, loading it the first time it is asked
+ * for. Cached images stay loaded until sel4utils_elf_image_cache_flush.
+ *
+ * @param loader the vspace to hold the master copy of the image.
+ * @param vka allocator for the master copy.
+ * @param image_name name of the image in the cpio archive.
+ *
+ * @return the cached image, NULL on error.
+ */
+sel4utils_elf_image_t *sel4utils_elf_image_cache_get(vspace_t *loader, vka_t *vka,
+                                                     char *image_name);
+
+/**
+ * Free every image cached for loader. No vspace may still be sharing them.
+ *
+ * @param loader the vspace passed to sel4utils_elf_image_cache_get.
+ */
+void sel4utils_elf_image_cache_flush(vspace_t *loader);
+
+/**
+ * Remove the shared frames of an image from a vspace and free the reservations made by
+ * sel4utils_elf_image_share or sel4utils_elf_load_shared. Pages that were copied belong
+ * to the loadee and are left for vspace_tear_down.
+ *
+ * @param loadee the vspace the image was shared with.
+ * @param loadee_vka allocator passed to sel4utils_elf_image_share.
+ * @param regions regions recorded by sel4utils_elf_image_share.
+ * @param num_regions number of regions.
+ */
+void sel4utils_elf_image_unshare(vspace_t *loadee, vka_t *loadee_vka,
+                                 sel4utils_elf_region_t *regions, int num_regions);
+
 /**
  * Parses an elf file and returns the number of loadable regions. The result of this
  * is used to calculate the number of regions to pass to sel4utils_elf_reserve and
@@ -106,5 +333,15 @@ sel4utils_elf_num_regions(char *image_name);
  */
 uintptr_t sel4utils_elf_get_vsyscall(char *image_name);
 
+/**
+ * Find a file in the cpio archive, using the same index as the elf loading functions.
+ *
+ * @param name name of the file in the cpio archive
+ * @param size the size of the file is returned here
+ *
+ * @return the contents of the file in the current vspace, NULL if it is not in the archive
+ */
+char *sel4utils_cpio_get_file(const char *name, unsigned long *size);
+
 #endif /* (defined CONFIG_LIB_SEL4_VKA && defined CONFIG_LIB_SEL4_VSPACE) */
 #endif /* SEL4UTILS_ELF_H */
@@ -142,6 +142,8 @@ typedef struct irq_server* irq_server_t;
  * @param[in] priority     The priority of spawned threads.
  * @param[in] params       Parameters to configure scheduling contexts with.
  * @param[in] sched_ctrl   Control cap for populating scheduling contexts.
+ * @param[in] affinity     The core to run spawned threads on, or one of the
+ *                         SEL4UTILS_AFFINITY_* policies to spread them across cores.
  * @param[in] irq_ctrl_cap Control cap for spawning IRQ caps
  * @param[in] sync_ep      The synchronous endpoint to send IRQ's to
  * @param[in] label        A label to use when sending a synchronous IPC
@@ -153,7 +155,7 @@ typedef struct irq_server* irq_server_t;
  * @return                 0 on success
  */
 int irq_server_new(vspace_t* vspace, vka_t* vka, seL4_CPtr cspace, seL4_Word priority,
-                   seL4_SchedParams_t params, seL4_CPtr sched_ctrl,
+                   seL4_SchedParams_t params, seL4_CPtr sched_ctrl, seL4_Word affinity,
                    seL4_CPtr irq_ctrl_cap, seL4_CPtr sync_ep,
                    seL4_Word label,
                    int nirqs, irq_server_t* irq_server);
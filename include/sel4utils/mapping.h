@@ -25,6 +25,13 @@ static int UNUSED sel4_supported_page_sizes[] = {12, 16, 21, 25};
 static int UNUSED sel4_supported_page_sizes[] = {12, 16, 20, 24};
 #endif
 
+/* size (in bits) of the virtual memory covered by a single page table */
+#if defined(ARM_HYP)
+#define SEL4UTILS_PAGE_TABLE_COVERAGE_BITS 21
+#else
+#define SEL4UTILS_PAGE_TABLE_COVERAGE_BITS 20
+#endif
+
 #define seL4_ARCH_Uncached_VMAttributes 0
 
 #define seL4_ARCH_Page_Map             seL4_ARM_Page_Map
@@ -42,6 +49,9 @@ static int UNUSED sel4_supported_page_sizes[] = {12, 16, 20, 24};
 /* sizes (in bits) of pages supported by sel4 in ascending order */
 static int UNUSED sel4_supported_page_sizes[] = {12, 21};
 
+/* size (in bits) of the virtual memory covered by a single page table */
+#define SEL4UTILS_PAGE_TABLE_COVERAGE_BITS 21
+
 #define seL4_ARCH_Page_Unmap                    seL4_X64_Page_Unmap
 #define seL4_ARCH_Page_Map                      seL4_X64_Page_Map
 #define seL4_ARCH_PageTable_Map                 seL4_X64_PageTable_Map
@@ -57,6 +67,9 @@ static int UNUSED sel4_supported_page_sizes[] = {12, 21};
 /* sizes (in bits) of pages supported by sel4 in ascending order */
 static int UNUSED sel4_supported_page_sizes[] = {12, 22};
 
+/* size (in bits) of the virtual memory covered by a single page table */
+#define SEL4UTILS_PAGE_TABLE_COVERAGE_BITS 22
+
 #define seL4_ARCH_Page_Map             seL4_IA32_Page_Map
 #define seL4_ARCH_Page_Unmap           seL4_IA32_Page_Unmap
 #define seL4_ARCH_PageTable_Map        seL4_IA32_PageTable_Map
@@ -106,6 +119,60 @@ static inline int sel4utils_map_page_leaky(vka_t *vka, seL4_CPtr pd, seL4_CPtr f
 
 #include <vspace/vspace.h>
 
+/* maximum number of pages in a mapping window */
+#define SEL4UTILS_MAP_WINDOW_MAX_PAGES 32
+
+/* A range of virtual address space with page tables and cslots set up ahead of time, for
+ * mapping 4K frames temporarily without allocating. Windows are only used by the functions
+ * they are passed to, and a window must only be used by one thread at a time. */
+typedef struct sel4utils_map_window {
+    vspace_t *vspace;
+    vka_t *vka;
+    reservation_t reservation;
+    void *vaddr;
+    uint32_t num_pages;
+    /* bit i is set if page i of the window is free */
+    uint32_t free;
+    seL4_CPtr slots[SEL4UTILS_MAP_WINDOW_MAX_PAGES];
+} sel4utils_map_window_t;
+
+/* Create a mapping window in a vspace.
+ *
+ * @param vka Allocator for the cslots of the window
+ * @param vspace sel4utils vspace to create the window in
+ * @param num_pages number of pages that can be mapped at once, at most
+ *                  SEL4UTILS_MAP_WINDOW_MAX_PAGES
+ *
+ * @return the window, NULL on error
+ */
+sel4utils_map_window_t *sel4utils_map_window_create(vka_t *vka, vspace_t *vspace, size_t num_pages);
+
+/* Destroy a mapping window. Nothing may be mapped in it.
+ *
+ * @param window window to destroy
+ *
+ * @return none
+ */
+void sel4utils_map_window_destroy(sel4utils_map_window_t *window);
+
+/* Copy a frame cap and map it in a window
+ *
+ * @param window window to map the frame in
+ * @param frame path to a 4K frame cap to copy
+ *
+ * @return virtual address of mapping, NULL if the window is full
+ */
+void *sel4utils_map_window_map(sel4utils_map_window_t *window, cspacepath_t *frame);
+
+/* Unmap a frame mapped by sel4utils_map_window_map and delete the copy of its cap
+ *
+ * @param window window the frame was mapped in
+ * @param mapping virtual address of mapping to remove
+ *
+ * @return 0 on success, -1 if mapping is not in the window
+ */
+int sel4utils_map_window_unmap(sel4utils_map_window_t *window, void *mapping);
+
 /* Duplicate a page cap and map it into a vspace
  *
  * @param vka Allocator for resources
@@ -129,6 +196,82 @@ void * sel4utils_dup_and_map(vka_t *vka, vspace_t *vspace, seL4_CPtr page, size_
  */
 void sel4utils_unmap_dup(vka_t *vka, vspace_t *vspace, void *mapping, size_t size_bits);
 
+/* Make code written into a range of a vspace visible to instruction fetch. This is done
+ * with one cache maintenance operation per frame in the range, and nothing on architectures
+ * with coherent instruction caches. Unmapped pages are skipped.
+ *
+ * @param vspace vspace the range is mapped in
+ * @param vaddr start of the range
+ * @param len length of the range in bytes
+ *
+ * @return none
+ */
+void sel4utils_unify_instruction(vspace_t *vspace, void *vaddr, size_t len);
+
+/* Copy a buffer into another vspace. Runs of frames of the same size that are contiguous
+ * in the target are mapped into the current vspace together, so large frames and
+ * consecutive small frames are copied with one mapping. Instruction caches are not
+ * maintained, use sel4utils_unify_instruction when copying code.
+ *
+ * @param vka Allocator for the cslots of the temporary mappings, frame caps of dst_vspace
+ *            must be in its cspace
+ * @param vspace the current vspace
+ * @param dst_vspace vspace to copy into, the range must be mapped
+ * @param dst address in dst_vspace to copy to
+ * @param src buffer in the current vspace
+ * @param len number of bytes to copy
+ *
+ * @return 0 on success, -1 if part of the range is not mapped or mapping failed
+ */
+int sel4utils_vspace_copy(vka_t *vka, vspace_t *vspace, vspace_t *dst_vspace, void *dst,
+                          const void *src, size_t len);
+
+/* As sel4utils_vspace_copy, mapping single 4K frames through a window instead of
+ * allocating a cslot and virtual address for each of them.
+ *
+ * @param window window in the current vspace, frame caps of dst_vspace must be in the
+ *               cspace of its vka
+ * @param dst_vspace vspace to copy into, the range must be mapped
+ * @param dst address in dst_vspace to copy to
+ * @param src buffer in the current vspace
+ * @param len number of bytes to copy
+ *
+ * @return 0 on success, -1 if part of the range is not mapped or mapping failed
+ */
+int sel4utils_map_window_copy(sel4utils_map_window_t *window, vspace_t *dst_vspace, void *dst,
+                              const void *src, size_t len);
+
+/* As sel4utils_vspace_copy, for when the frame caps of dst_vspace are in the cspace of a
+ * different allocator
+ *
+ * @param vka Allocator for the cslots of the temporary mappings
+ * @param vspace the current vspace
+ * @param dst_vka Allocator whose cspace holds the frame caps of dst_vspace
+ * @param dst_vspace vspace to copy into, the range must be mapped
+ * @param dst address in dst_vspace to copy to
+ * @param src buffer in the current vspace
+ * @param len number of bytes to copy
+ *
+ * @return 0 on success, -1 if part of the range is not mapped or mapping failed
+ */
+int sel4utils_vspace_copy_vka(vka_t *vka, vspace_t *vspace, vka_t *dst_vka, vspace_t *dst_vspace,
+                              void *dst, const void *src, size_t len);
+
+/* Copy out of another vspace. The opposite of sel4utils_vspace_copy
+ *
+ * @param vka Allocator for the cslots of the temporary mappings, frame caps of src_vspace
+ *            must be in its cspace
+ * @param vspace the current vspace
+ * @param src_vspace vspace to copy from, the range must be mapped
+ * @param dst buffer in the current vspace
+ * @param src address in src_vspace to copy from
+ * @param len number of bytes to copy
+ *
+ * @return 0 on success, -1 if part of the range is not mapped or mapping failed
+ */
+int sel4utils_vspace_copy_from(vka_t *vka, vspace_t *vspace, vspace_t *src_vspace, void *dst,
+                               const void *src, size_t len);
+
 #endif /* CONFIG_LIB_SEL4_VSPACE */
 #endif /* CONFIG_LIB_SEL4_VKA */
 
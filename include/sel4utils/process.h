@@ -28,6 +28,14 @@ struct object_node {
     object_node_t *next;
 };
 
+/* a file from the cpio archive mapped into a process, see sel4utils_map_cpio_file */
+typedef struct sel4utils_cpio_mapping {
+    reservation_t reservation;
+    void *vaddr;
+    size_t num_pages;
+    struct sel4utils_cpio_mapping *next;
+} sel4utils_cpio_mapping_t;
+
 typedef struct {
     vka_object_t pd;
     vspace_t vspace;
@@ -45,6 +53,10 @@ typedef struct {
      * you want to implement */
     int num_elf_regions;
     sel4utils_elf_region_t *elf_regions;
+    /* if the elf regions are shared from a preloaded image, this is the image */
+    sel4utils_elf_image_t *elf_image;
+    /* files from the cpio archive mapped into the process */
+    sel4utils_cpio_mapping_t *cpio_mappings;
 } sel4utils_process_t;
 
 /* sel4utils processes start with some caps in their cspace.
@@ -68,6 +80,22 @@ typedef struct {
     char *image_name;
     /* Do you want the elf image preloaded? */
     bool do_elf_load;
+    /* if so, should read only segments be shared with other processes loaded from the
+     * same image? See sel4utils_elf_image_cache_get */
+    bool share_elf_text;
+    /* otherwise, should pages that are only bss be left to a lazy fault handler? See
+     * sel4utils_elf_load_lazy_bss */
+    bool lazy_bss;
+    /* or should the whole image be left to a lazy fault handler, which fills each page from
+     * the cpio archive when it is first touched? See sel4utils_elf_load_lazy */
+    bool lazy_elf_load;
+    /* if not, an optional preloaded image to share the regions of. Writable regions are
+     * copy on write, see sel4utils_handle_cow_fault */
+    sel4utils_elf_image_t *elf_image;
+    /* with lazy_bss, lazy_elf_load or elf_image, the vspace of the process allocates from
+     * this instead, as its faults are served by sel4utils_start_lazy_fault_handler while we
+     * keep allocating. Required if we create the vspace, and must not be the process' vka */
+    vka_t *fault_vka;
 
     /* otherwise what is the entry point and sysinfo? */
     void *entry_point;
@@ -114,6 +142,11 @@ typedef struct {
     seL4_CPtr sched_context;
     /* endpoint for temporal faults (can be seL4_CapNull) */
     seL4_CPtr temporal_fault_endpoint;
+    /* core to run the process on, see sel4utils_thread_config_t */
+    seL4_Word affinity;
+    /* fill the process's stack with SEL4UTILS_STACK_CANARY so that
+     * sel4utils_thread_stack_usage can be used on process->thread */
+    int stack_canary;
 } sel4utils_process_config_t;
 
 /**
@@ -235,6 +268,36 @@ seL4_CPtr sel4utils_copy_cap_to_process(sel4utils_process_t *process, cspacepath
  */
 seL4_CPtr sel4utils_mint_cap_to_process(sel4utils_process_t *process, cspacepath_t src, seL4_CapRights rights, seL4_CapData_t data);
 
+/**
+ * Map a file from the cpio archive into a process read only, without copying it. The frames
+ * of the archive in vspace are shared with the process, so the archive must be in frames
+ * that vspace has caps to, eg. the image of the initial task bootstrapped with
+ * sel4utils_bootstrap_vspace_with_bootinfo. If the file starts or ends part way through a
+ * page, that part of it is copied into a new frame instead, so that the process cannot
+ * read whatever else is on the page.
+ *
+ * The mapping is removed by sel4utils_unmap_cpio_file or when the process is destroyed.
+ *
+ * @param process process to map the file into
+ * @param vka allocator used to allocate objects for this process
+ * @param vspace the current vspace, which the archive is mapped in
+ * @param name name of the file in the cpio archive
+ * @param size the size of the file is returned here
+ *
+ * @return the address of the file in the process, NULL on error.
+ */
+void *sel4utils_map_cpio_file(sel4utils_process_t *process, vka_t *vka, vspace_t *vspace,
+                              char *name, unsigned long *size);
+
+/**
+ * Remove a mapping made with sel4utils_map_cpio_file.
+ *
+ * @param process process the file is mapped into
+ * @param vka allocator used to allocate objects for this process
+ * @param file address of the file in the process, as returned by sel4utils_map_cpio_file
+ */
+void sel4utils_unmap_cpio_file(sel4utils_process_t *process, vka_t *vka, void *file);
+
 /**
  * Destroy a process.
  *
@@ -24,4 +24,50 @@
  */
 int sel4utils_run_on_stack(vspace_t *vspace, int (*func)(void));
 
+/**
+ * The size a stack of at least size bytes is rounded up to. Stacks are allocated in power
+ * of two numbers of pages.
+ *
+ * @param size the size of stack wanted.
+ * @return the size of stack that sel4utils_new_stack allocates for size.
+ */
+size_t sel4utils_stack_size(size_t size);
+
+/**
+ * Allocate a stack with an unmapped guard page below it. Stacks freed with
+ * sel4utils_free_stack are reused, so that the stack may hold old data.
+ *
+ * @param vspace interface to allocate stack with
+ * @param size minimum size of the stack in bytes, see sel4utils_stack_size
+ * @return the top of the stack, NULL on failure.
+ */
+void *sel4utils_new_stack(vspace_t *vspace, size_t size);
+
+/**
+ * Free a stack allocated by sel4utils_new_stack. Up to CONFIG_SEL4UTILS_STACK_POOL_SIZE
+ * stacks of each size are kept mapped for reuse instead of being unmapped.
+ *
+ * @param vspace the vspace the stack was allocated in
+ * @param stack_top the top of the stack
+ * @param size the size the stack was allocated with
+ */
+void sel4utils_free_stack(vspace_t *vspace, void *stack_top, size_t size);
+
+/**
+ * Unmap every stack kept for reuse in a vspace.
+ *
+ * @param vspace the vspace the stacks were allocated in
+ * @param vka the vka to free the stack frames to, as for vspace_unmap_pages
+ */
+void sel4utils_stack_pool_flush(vspace_t *vspace, vka_t *vka);
+
+/**
+ * Forget the stacks kept for reuse in a vspace without unmapping them. This must be done
+ * before tearing down a vspace that stacks were freed in, otherwise a vspace created
+ * later with the same data could be handed the old stacks.
+ *
+ * @param vspace the vspace the stacks were allocated in
+ */
+void sel4utils_stack_pool_discard(vspace_t *vspace);
+
 #endif /* __SEL4UTILS_STACK_H */
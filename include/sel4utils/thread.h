@@ -33,13 +33,31 @@
 
 #define SEL4UTILS_TIMESLICE (CONFIG_TIMER_TICK_MS * CONFIG_TIME_SLICE * US_IN_MS)
 
+/* affinities that let the library choose the core of a thread: the next core in turn, or the
+ * core with the fewest threads configured by this library */
+#define SEL4UTILS_AFFINITY_ROUND_ROBIN  ((seL4_Word) -1)
+#define SEL4UTILS_AFFINITY_LEAST_LOADED ((seL4_Word) -2)
+
+/* pattern that stacks are filled with to measure their use, see sel4utils_thread_stack_usage */
+#define SEL4UTILS_STACK_CANARY ((seL4_Word) 0x5a5aa5a5)
+
 typedef struct sel4utils_thread {
     vka_object_t tcb;
     void *stack_top;
+    size_t stack_size;
+    /* set if the stack was filled with SEL4UTILS_STACK_CANARY when it was configured */
+    int stack_canary;
     seL4_CPtr ipc_buffer;
     seL4_Word ipc_buffer_addr;
     int own_sc;
     vka_object_t sched_context;
+    /* set if the stack and ipc buffer are part of a region shared with other threads, see
+     * sel4utils_configure_threads */
+    int batched;
+    /* core the thread was last placed on. placed is set while it counts towards the
+     * threads on that core, which threads waiting in a thread pool do not */
+    int placed;
+    seL4_Word affinity;
 } sel4utils_thread_t;
 
 typedef struct sel4utils_thread_config {
@@ -67,8 +85,34 @@ typedef struct sel4utils_thread_config {
     seL4_CPtr sched_control;
     /* otherwise provide a sched control cap (can be seL4_CapNull) */
     seL4_CPtr sched_context;
+    /* core to run the thread on, or one of the SEL4UTILS_AFFINITY_* policies. Only used
+     * on multicore kernels */
+    seL4_Word affinity;
+    /* size of stack in bytes, 0 for CONFIG_SEL4UTILS_STACK_SIZE. Rounded up to a size
+     * from sel4utils_stack_size */
+    size_t stack_size;
+    /* fill the stack with SEL4UTILS_STACK_CANARY, so that sel4utils_thread_stack_usage can
+     * measure how much of it the thread uses */
+    int stack_canary;
 } sel4utils_thread_config_t;
 
+/* A cache of configured threads, so that threads can be created and destroyed without
+ * allocating, see sel4utils_thread_pool_acquire */
+typedef struct sel4utils_thread_pool {
+    vka_t *vka;
+    vspace_t *parent;
+    vspace_t *alloc;
+    /* configuration that new threads in the pool are created with */
+    sel4utils_thread_config_t config;
+    /* set once a thread has been acquired with a different configuration, after which
+     * threads are always reconfigured when they are acquired */
+    int reconfigured;
+    /* stopped threads ready to be handed out */
+    int num_free;
+    int max_free;
+    sel4utils_thread_t *free;
+} sel4utils_thread_pool_t;
+
 typedef struct sel4utils_checkpoint {
     uint32_t *stack;
     seL4_UserContext regs;
@@ -123,6 +167,30 @@ int sel4utils_configure_passive_thread(vka_t *vka, vspace_t *parent, vspace_t *a
 int sel4utils_configure_thread_config(vka_t *vka, vspace_t *parent, vspace_t *alloc,
                                       sel4utils_thread_config_t config, sel4utils_thread_t *res);
 
+/**
+ * Configure num_threads threads with the same configuration at once. The stacks and ipc
+ * buffers of all of them are placed in one reservation, each stack with a guard page below
+ * it, and the ipc buffers are all initialised through a single temporary mapping. Each
+ * thread is placed separately, so an affinity policy spreads the threads across cores.
+ *
+ * The threads can be cleaned up one at a time with sel4utils_clean_up_thread, but the
+ * reservation is only released by sel4utils_clean_up_threads, which must be given it.
+ *
+ * @param vka initialised vka to allocate objects with
+ * @param parent vspace structure of the thread calling this function, used for temporary mappings
+ * @param alloc initialised vspace structure to allocate virtual memory with
+ * @param config configuration for every thread.
+ * @param num_threads number of threads to configure.
+ * @param threads array of num_threads uninitialised sel4utils_thread_t data structures that will
+ *                be initialised after this operation.
+ * @param reservation returns the reservation holding the stacks and ipc buffers.
+ *
+ * @return 0 on success, -1 on failure, in which case nothing is left allocated.
+ */
+int sel4utils_configure_threads(vka_t *vka, vspace_t *parent, vspace_t *alloc,
+                                sel4utils_thread_config_t config, int num_threads,
+                                sel4utils_thread_t threads[], reservation_t *reservation);
+
 /**
  * Start a thread, allocating any resources required.
  * The third argument to the thread (in r2 for arm, on stack for ia32) will be the
@@ -180,6 +248,87 @@ int sel4utils_start_thread(sel4utils_thread_t *thread, void *entry_point, void *
  */
 void sel4utils_clean_up_thread(vka_t *vka, vspace_t *alloc, sel4utils_thread_t *thread);
 
+/**
+ * Create a pool of threads. The pool keeps up to size threads with their tcb, ipc buffer,
+ * stack and scheduling context (if config.create_sc is set) configured, so that acquiring
+ * and releasing them only costs a few system calls.
+ *
+ * @param pool uninitialised pool struct.
+ * @param vka initialised vka to allocate objects with
+ * @param parent vspace structure of the thread calling this function, used for temporary mappings
+ * @param alloc initialised vspace structure to allocate virtual memory with
+ * @param config configuration to create threads with.
+ * @param size the number of threads to keep, all of them are created up front.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int sel4utils_thread_pool_init(sel4utils_thread_pool_t *pool, vka_t *vka, vspace_t *parent,
+                               vspace_t *alloc, sel4utils_thread_config_t config, int size);
+
+/**
+ * Take a configured thread from a pool, configuring a new one if the pool is empty. The
+ * thread is stopped, start it with sel4utils_start_thread.
+ *
+ * @param pool the pool to take the thread from.
+ * @param config if not NULL, the thread is reconfigured with this configuration instead of
+ *               the one the pool was created with. config->create_sc must match the pool's
+ *               and the stack is not reallocated, so config->stack_size must fit in it.
+ * @param res an uninitialised sel4utils_thread_t data structure that will be initialised
+ *            after this operation.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int sel4utils_thread_pool_acquire(sel4utils_thread_pool_t *pool, sel4utils_thread_config_t *config,
+                                  sel4utils_thread_t *res);
+
+/**
+ * Stop a thread and give it back to the pool it was acquired from. If the pool is full, the
+ * thread is cleaned up instead.
+ *
+ * @param pool the pool the thread was acquired from.
+ * @param thread the thread to release, it is not usable afterwards.
+ */
+void sel4utils_thread_pool_release(sel4utils_thread_pool_t *pool, sel4utils_thread_t *thread);
+
+/**
+ * Clean up every thread in a pool and free the pool. Threads that are still acquired must be
+ * cleaned up with sel4utils_clean_up_thread.
+ *
+ * @param pool the pool to destroy.
+ */
+void sel4utils_thread_pool_destroy(sel4utils_thread_pool_t *pool);
+
+/**
+ * Release the resources of threads configured together by sel4utils_configure_threads,
+ * including the region their stacks and ipc buffers were in.
+ *
+ * @param vka the vka interface that the threads were initialised with
+ * @param alloc the allocation interface that the threads were initialised with
+ * @param reservation the reservation returned by sel4utils_configure_threads
+ * @param num_threads number of threads passed to sel4utils_configure_threads
+ * @param threads the threads, any of them that have already been cleaned up are skipped
+ */
+void sel4utils_clean_up_threads(vka_t *vka, vspace_t *alloc, reservation_t reservation,
+                                int num_threads, sel4utils_thread_t threads[]);
+
+/**
+ * Measure the most stack a thread has used, by scanning up from the bottom of its stack for
+ * the first word that is not SEL4UTILS_STACK_CANARY. The thread must have been configured
+ * with stack_canary set. Stack pages are mapped into parent one at a time to scan them,
+ * unless the thread runs in parent. Stacks are not refilled when a thread is reused from a
+ * pool, so the result covers every user of the thread since it was configured.
+ *
+ * @param vka allocator for the temporary mappings
+ * @param parent vspace structure of the thread calling this function
+ * @param alloc the allocation interface that the thread was initialised with
+ * @param thread the thread to measure
+ * @param used the high water mark of the stack, in bytes from the top, is returned here
+ *
+ * @return 0 on success, -1 if the stack was not filled or could not be mapped.
+ */
+int sel4utils_thread_stack_usage(vka_t *vka, vspace_t *parent, vspace_t *alloc,
+                                 sel4utils_thread_t *thread, size_t *used);
+
 /**
  * Checkpoint a thread at its current state.
  *
@@ -228,6 +377,40 @@ int sel4utils_start_fault_handler(seL4_CPtr fault_endpoint, vka_t *vka, vspace_t
                                   seL4_CPtr sched_control, sel4utils_thread_t *res);
 
 
+/**
+ * Start a thread that services page faults on lazy reservations (see
+ * sel4utils_reserve_range_lazy) in another vspace. Page faults on an untouched page of a
+ * lazy reservation are handled by mapping a new frame and restarting the faulting thread,
+ * and write faults on shared pages of copy on write reservations (see
+ * sel4utils_elf_image_share) by copying the page. Anything else is printed as
+ * sel4utils_start_fault_handler would and the faulting thread is left blocked.
+ *
+ * The handler allocates frames from the vka of target while it runs, so target must have
+ * a vka of its own: starting the handler fails if it is vka. Nothing else may modify target,
+ * or allocate from its vka, until the handler is stopped. The page tables of lazy
+ * reservations should be in place before the handler starts (see sel4utils_prepare_range),
+ * otherwise the handler allocates them through the allocated object callback of target.
+ *
+ * Pages are filled and copied through a window the handler sets up in vspace before it
+ * starts (see sel4utils_fill_window_t), so handling faults leaves vspace and vka alone.
+ *
+ * @param fault_endpoint the fault endpoint of the threads in target, eg. a process' fault endpoint
+ * @param vka allocator
+ * @param vspace vspace to create the handler in (this library must be mapped into that vspace).
+ * @param target the sel4utils vspace the faulting threads run in.
+ * @param prio the priority to run the thread at (recommend highest possible)
+ * @param cspace the cspace that the fault_endpoint is in
+ * @param data the cspace_data for that cspace (with correct guard)
+ * @param name the name of the threads to print if they fault
+ * @param thread the thread data structure to populate
+ *
+ * @return 0 on success.
+ */
+int sel4utils_start_lazy_fault_handler(seL4_CPtr fault_endpoint, vka_t *vka, vspace_t *vspace,
+                                       vspace_t *target, uint8_t prio, seL4_CPtr cspace,
+                                       seL4_CapData_t data, char *name, seL4_CPtr sched_control,
+                                       sel4utils_thread_t *res);
+
 /**
  * Pretty print a fault messge.
  *
@@ -35,6 +35,7 @@
 
 #include <vspace/vspace.h>
 #include <vka/vka.h>
+#include <vka/object.h>
 #include <sel4utils/util.h>
 
 /* These definitions are only here so that you can take the size of them.
@@ -53,6 +54,25 @@ typedef struct bottom_level {
     uint32_t  cookies[VSPACE_LEVEL_SIZE];
 } bottom_level_t;
 
+/* Summary of the bottom levels that is kept up to date as entries are written,
+ * so that searches for free virtual memory can skip over whole bottom levels
+ * that are entirely empty or entirely used. */
+#define VSPACE_INDEX_WORD_BITS 32
+#define VSPACE_INDEX_WORDS (VSPACE_LEVEL_SIZE / VSPACE_INDEX_WORD_BITS)
+
+typedef struct sel4utils_free_index {
+    /* number of non empty (mapped or reserved) entries in each bottom level */
+    uint16_t used[VSPACE_LEVEL_SIZE];
+    /* bit n is set if bottom level n has at least one free entry */
+    uint32_t has_free[VSPACE_INDEX_WORDS];
+    /* bit n is set if has_free[n] is non zero */
+    uint32_t has_free_summary;
+    /* bit n is set if bottom level n has at least one non empty entry */
+    uint32_t has_used[VSPACE_INDEX_WORDS];
+    /* bit n is set if has_used[n] is non zero */
+    uint32_t has_used_summary;
+} sel4utils_free_index_t;
+
 typedef int(*sel4utils_map_page_fn)(vspace_t *vspace, seL4_CPtr cap, void *vaddr, seL4_CapRights rights, int cacheable, size_t size_bits);
 
 struct sel4utils_res {
@@ -61,11 +81,52 @@ struct sel4utils_res {
     seL4_CapRights rights;
     int cacheable;
     int malloced;
-    struct sel4utils_res *next;
+    /* pages in a lazy reservation are allocated when they are first touched,
+     * see sel4utils_handle_lazy_fault */
+    int lazy;
+    /* if source_vspace is set, the part of a lazy page that is in
+     * [source_vaddr, source_vaddr + source_size) is filled from source, an address in
+     * source_vspace, see sel4utils_set_lazy_source */
+    vspace_t *source_vspace;
+    void *source;
+    void *source_vaddr;
+    size_t source_size;
+    /* frames mapped into a copy on write reservation are shared and mapped read only,
+     * see sel4utils_handle_cow_fault */
+    int cow;
+    /* code runs from the reservation, so pages filled in by the fault handlers need their
+     * instruction caches made coherent, see sel4utils_set_executable */
+    int executable;
+    /* reservations are kept in an AVL tree ordered by start address, augmented with
+     * the largest end address of each subtree so it can be searched as an interval tree */
+    struct sel4utils_res *left;
+    struct sel4utils_res *right;
+    void *max_end;
+    int height;
 };
 
 typedef struct sel4utils_res sel4utils_res_t;
 
+/* frame batches are hashed by cookie into 2^SEL4UTILS_FRAME_BATCH_BUCKET_BITS lists */
+#define SEL4UTILS_FRAME_BATCH_BUCKET_BITS 5
+#define SEL4UTILS_FRAME_BATCH_BUCKETS BIT(SEL4UTILS_FRAME_BATCH_BUCKET_BITS)
+
+/* A run of frames that new_pages retyped out of a single untyped. Every frame in the
+ * batch records the untyped's cookie, and the untyped is given back once the last of
+ * the frames has been unmapped and freed.
+ *
+ * Frames unmapped with VSPACE_PRESERVE, or left by tearing the vspace down with it, are
+ * not tracked any further. The untyped they came from stays allocated, and once the
+ * caller has deleted every such frame it is up to the caller to free the untyped, whose
+ * cookie is the frames' cookie, through the vka the vspace was created with. */
+typedef struct sel4utils_frame_batch {
+    vka_object_t untyped;
+    size_t frame_bits;
+    /* number of frames from this batch that have not been freed */
+    uint32_t frames;
+    struct sel4utils_frame_batch *next;
+} sel4utils_frame_batch_t;
+
 typedef struct sel4utils_alloc_data {
     seL4_CPtr page_directory;
     vka_t *vka;
@@ -74,7 +135,9 @@ typedef struct sel4utils_alloc_data {
     void *last_allocated;
     vspace_t *bootstrap;
     sel4utils_map_page_fn map_page;
-    sel4utils_res_t *reservation_head;
+    sel4utils_res_t *reservation_root;
+    sel4utils_free_index_t free_index;
+    sel4utils_frame_batch_t *frame_batches[SEL4UTILS_FRAME_BATCH_BUCKETS];
 } sel4utils_alloc_data_t;
 
 static inline sel4utils_res_t *
@@ -282,6 +345,203 @@ void sel4utils_free_reservation_no_alloc(vspace_t *vspace, sel4utils_res_t *rese
 int sel4utils_move_resize_reservation(vspace_t *vspace, reservation_t reservation, void *vaddr,
                                       size_t bytes);
 
+/**
+ * Reserve a range in a vspace that is backed by frames on demand rather than up front.
+ * Pages of the range are allocated and mapped by sel4utils_handle_lazy_fault, which is
+ * normally called by a fault handler started with sel4utils_start_lazy_fault_handler
+ * when a thread in the vspace first touches them.
+ *
+ * @param vspace the virtual memory allocator to use.
+ * @param bytes the size in bytes of the range.
+ * @param rights the rights to map the pages in with.
+ * @param cacheable 1 if the pages should be mapped with cacheable attributes. 0 for DMA.
+ * @param vaddr the virtual address of the reserved range will be returned here.
+ *
+ * @return a reservation to use with the vspace interface, res is NULL on failure.
+ */
+reservation_t sel4utils_reserve_range_lazy(vspace_t *vspace, size_t bytes, seL4_CapRights rights,
+                                           int cacheable, void **vaddr);
+
+/**
+ * Reserve a range at a specific address that is backed by frames on demand, see
+ * sel4utils_reserve_range_lazy. Frames may still be mapped into the range up front, only
+ * the pages left unmapped are allocated on demand.
+ *
+ * @param vspace the virtual memory allocator to use.
+ * @param vaddr the virtual address to start the range at.
+ * @param bytes the size in bytes of the range.
+ * @param rights the rights to map the pages in with.
+ * @param cacheable 1 if the pages should be mapped with cacheable attributes. 0 for DMA.
+ *
+ * @return a reservation to use with the vspace interface, res is NULL on failure.
+ */
+reservation_t sel4utils_reserve_range_at_lazy(vspace_t *vspace, void *vaddr, size_t bytes,
+                                              seL4_CapRights rights, int cacheable);
+
+#define SEL4UTILS_FILL_WINDOW_PAGES 2
+
+/* Pages of a vspace, with their page table and cslots set up in advance, that
+ * sel4utils_handle_lazy_fault and sel4utils_handle_cow_fault map frames into to fill them.
+ * Mapping into the window goes straight to the kernel, so it neither changes the vspace's
+ * book keeping nor allocates from its vka, and a fault handler with a window of its own can
+ * fill pages while other threads use the vspace. */
+typedef struct sel4utils_fill_window {
+    vspace_t *vspace;
+    vka_t *vka;
+    seL4_CPtr page_directory;
+    reservation_t reservation;
+    void *vaddr;
+    seL4_CPtr slots[SEL4UTILS_FILL_WINDOW_PAGES];
+} sel4utils_fill_window_t;
+
+/**
+ * Create a fill window in a vspace, see sel4utils_fill_window_t.
+ *
+ * @param window uninitialised window to fill in.
+ * @param vka allocator for the cslot of the window. Frame caps of the vspaces that
+ *            faults are handled for must be in its cspace.
+ * @param vspace the sel4utils vspace the fault handler runs in.
+ *
+ * @return 0 on success, -1 on error, in which case nothing is left allocated.
+ */
+int sel4utils_fill_window_create(sel4utils_fill_window_t *window, vka_t *vka, vspace_t *vspace);
+
+/**
+ * Destroy a fill window. Nothing may be using it.
+ *
+ * @param window window to destroy.
+ */
+void sel4utils_fill_window_destroy(sel4utils_fill_window_t *window);
+
+/**
+ * Back the page containing vaddr with a new frame if it is an untouched page of a lazy
+ * reservation. Initial contents set with sel4utils_set_lazy_source are copied in through
+ * window, which must be in the source vspace.
+ *
+ * The frame is allocated from vspace and its vka, so nothing else may modify vspace, or
+ * allocate from its vka, at the same time.
+ *
+ * @param vspace the virtual memory allocator to use.
+ * @param window window to fill the page through, may be NULL if the reservation has
+ *               no initial contents.
+ * @param vaddr the faulting address.
+ *
+ * @return 0 if a frame was mapped, -1 if vaddr is not an untouched page of a lazy
+ *         reservation, allocation failed, or the page could not be filled.
+ */
+int sel4utils_handle_lazy_fault(vspace_t *vspace, sel4utils_fill_window_t *window, void *vaddr);
+
+/**
+ * Give the pages of a lazy reservation initial contents. When a page that overlaps
+ * [vaddr, vaddr + size) is first touched, sel4utils_handle_lazy_fault copies the overlapping
+ * part from source instead of leaving the new frame zeroed. The source must stay mapped in
+ * source_vspace, and unchanged, for as long as the reservation exists.
+ *
+ * @param vspace the virtual memory allocator to use.
+ * @param reservation a lazy reservation, see sel4utils_reserve_range_lazy.
+ * @param source_vspace the vspace the source is mapped in, normally the vspace of the fault
+ *                      handler. Pages are filled through a sel4utils_fill_window_t in it,
+ *                      so source_vspace is only read while faults are handled.
+ * @param vaddr the virtual address in the reservation that the source starts at.
+ * @param source the address of the initial contents in source_vspace.
+ * @param size the size in bytes of the initial contents.
+ *
+ * @return 0 on success, -1 if the reservation is not lazy or does not contain the range.
+ */
+int sel4utils_set_lazy_source(vspace_t *vspace, reservation_t reservation, vspace_t *source_vspace,
+                              void *vaddr, void *source, size_t size);
+
+/**
+ * Mark a reservation as holding code. Pages that sel4utils_handle_lazy_fault or
+ * sel4utils_handle_cow_fault fill in are then made visible to instruction fetch, which
+ * is skipped for everything else.
+ *
+ * @param vspace the virtual memory allocator to use.
+ * @param reservation the reservation to mark.
+ */
+void sel4utils_set_executable(vspace_t *vspace, reservation_t reservation);
+
+/**
+ * Reserve a range at a specific address for copy on write sharing. Frames that are mapped
+ * into the reservation with vspace_map_pages_at_vaddr are mapped without write rights,
+ * whatever the rights of the reservation. The first write to one of them should be passed
+ * to sel4utils_handle_cow_fault, which gives the vspace a private copy of the page.
+ *
+ * @param vspace the virtual memory allocator to use.
+ * @param vaddr the virtual address to start the range at.
+ * @param bytes the size in bytes of the range.
+ * @param rights the rights private copies of pages will be mapped with.
+ * @param cacheable 1 if the pages should be mapped with cacheable attributes. 0 for DMA.
+ *
+ * @return a reservation to use with the vspace interface, res is NULL on failure.
+ */
+reservation_t sel4utils_reserve_range_at_cow(vspace_t *vspace, void *vaddr, size_t bytes,
+                                             seL4_CapRights rights, int cacheable);
+
+/**
+ * Replace the shared page containing vaddr with a private, writable copy if it is in a copy
+ * on write reservation. The shared frame cap is deleted from the cspace of the vspace's vka,
+ * so it must have been copied there for this vspace alone.
+ *
+ * The copy is allocated from vspace and its vka, so nothing else may modify vspace, or
+ * allocate from its vka, at the same time.
+ *
+ * @param vspace the virtual memory allocator to use.
+ * @param window window to map both pages through for the copy.
+ * @param vaddr the faulting address.
+ *
+ * @return 0 if the page was copied, -1 if vaddr is not a shared page of a copy on write
+ *         reservation or the copy failed.
+ */
+int sel4utils_handle_cow_fault(vspace_t *vspace, sel4utils_fill_window_t *window, void *vaddr);
+
+/**
+ * Allocate and map enough new frames to cover bytes, choosing the frame sizes instead of
+ * leaving it to the caller. The range is aligned to the largest page size that fits in it
+ * and filled with the largest frames that are aligned and fit, falling back to smaller
+ * frames at the end of the range or when no frames of a size can be allocated.
+ *
+ * Since the range is made of frames of different sizes it should be freed with
+ * sel4utils_unmap_pages_auto.
+ *
+ * @param vspace the virtual memory allocator to use.
+ * @param rights the rights to map the frames with.
+ * @param bytes the number of bytes to allocate, rounded up to a multiple of 4K.
+ *
+ * @return the start of the new range, NULL on failure.
+ */
+void *sel4utils_new_pages_auto(vspace_t *vspace, seL4_CapRights rights, size_t bytes);
+
+/**
+ * Unmap every frame in a range, working out the size of each frame from the vspace's
+ * book keeping.
+ *
+ * @param vspace the virtual memory allocator to use.
+ * @param vaddr the start of the range, which must be the start of a frame.
+ * @param bytes the size of the range in bytes.
+ * @param vka the allocator to free the frames to, VSPACE_FREE to use the vspace's own
+ *            allocator or NULL to leave them allocated.
+ */
+void sel4utils_unmap_pages_auto(vspace_t *vspace, void *vaddr, size_t bytes, vka_t *vka);
+
+/**
+ * Allocate and map all the page tables needed to map frames in a range up front, so that
+ * mapping the frames afterwards never has to stop and create one. This is worthwhile
+ * before populating a large reservation with small pages. Every paging structure
+ * created is reported through the vspace's allocated_object function.
+ *
+ * Only vspaces that map into an seL4 page directory are supported. Do not prepare
+ * ranges that will be mapped with frames as large as a page table's coverage, the
+ * page tables would be in the way.
+ *
+ * @param vspace the virtual memory allocator to use.
+ * @param vaddr the start of the range to prepare.
+ * @param bytes the size of the range in bytes.
+ *
+ * @return 0 on success.
+ */
+int sel4utils_prepare_range(vspace_t *vspace, void *vaddr, size_t bytes);
+
 /*
  * Copy the code and data segment (the image effectively) from current vspace
  * into clone vspace. The clone vspace should be initialised.
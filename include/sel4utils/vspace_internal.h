@@ -11,6 +11,8 @@
 #ifndef __SEL4UILS_VSPACE_PRIVATE_H
 #define __SEL4UILS_VSPACE_PRIVATE_H
 
+#include <string.h>
+
 #include <vka/vka.h>
 #include <vspace/vspace.h>
 
@@ -46,11 +48,31 @@
 
 #define LEVEL_MASK MASK_UNSAFE(VSPACE_LEVEL_BITS)
 
+/* Amount of virtual memory covered by a single bottom level */
+#define BYTES_PER_LEVEL BIT(TOP_LEVEL_BITS_OFFSET)
+
 #define BOTTOM_LEVEL_INDEX(x) ((((uint32_t) ((seL4_Word)(x))) >> BOTTOM_LEVEL_BITS_OFFSET) & LEVEL_MASK)
 #define TOP_LEVEL_INDEX(x) ((((uint32_t) ((seL4_Word)(x))) >> TOP_LEVEL_BITS_OFFSET)  & LEVEL_MASK)
 
+/* A bottom level that is entirely covered by a single large frame is not expanded into
+ * per 4K entries. Instead the top level entry points at a large_level_t, tagged with
+ * LARGE_LEVEL_TAG, which records the frame and sets aside whatever bottom level was there
+ * before so it can be put back when the frame is unmapped. */
+#define LARGE_LEVEL_TAG 0x1
+
+typedef struct large_level {
+    seL4_CPtr cap;
+    uint32_t cookie;
+    size_t size_bits;
+    /* bottom level and free index count from before the frame was mapped */
+    bottom_level_t *saved;
+    uint32_t saved_used;
+} large_level_t;
+
 int assure_level(vspace_t *vspace, void *vaddr);
 int bootstrap_create_level(vspace_t *vspace, void *vaddr);
+int large_level_map(vspace_t *vspace, void *vaddr, seL4_CPtr cap, size_t size_bits, uint32_t cookie);
+void large_level_release(vspace_t *vspace, void *vaddr);
 
 static inline sel4utils_alloc_data_t *
 get_alloc_data(vspace_t *vspace)
@@ -58,6 +80,120 @@ get_alloc_data(vspace_t *vspace)
     return (sel4utils_alloc_data_t *) vspace->data;
 }
 
+static inline int
+is_large_level(bottom_level_t *level)
+{
+    return level != (void *) RESERVED && ((uintptr_t) level & LARGE_LEVEL_TAG);
+}
+
+static inline large_level_t *
+to_large_level(bottom_level_t *level)
+{
+    assert(is_large_level(level));
+    return (large_level_t *) ((uintptr_t) level & ~((uintptr_t) LARGE_LEVEL_TAG));
+}
+
+static inline void
+free_index_set(uint32_t words[], uint32_t *summary, uint32_t bit)
+{
+    words[bit / VSPACE_INDEX_WORD_BITS] |= BIT(bit % VSPACE_INDEX_WORD_BITS);
+    *summary |= BIT(bit / VSPACE_INDEX_WORD_BITS);
+}
+
+static inline void
+free_index_unset(uint32_t words[], uint32_t *summary, uint32_t bit)
+{
+    words[bit / VSPACE_INDEX_WORD_BITS] &= ~BIT(bit % VSPACE_INDEX_WORD_BITS);
+    if (words[bit / VSPACE_INDEX_WORD_BITS] == 0) {
+        *summary &= ~BIT(bit / VSPACE_INDEX_WORD_BITS);
+    }
+}
+
+/* find the first set bit at or after bit, returns VSPACE_LEVEL_SIZE if there is none */
+static inline uint32_t
+free_index_next(uint32_t words[], uint32_t summary, uint32_t bit)
+{
+    if (bit >= VSPACE_LEVEL_SIZE) {
+        return VSPACE_LEVEL_SIZE;
+    }
+
+    uint32_t word = bit / VSPACE_INDEX_WORD_BITS;
+    uint32_t bits = words[word] & (~0u << (bit % VSPACE_INDEX_WORD_BITS));
+    if (bits != 0) {
+        return word * VSPACE_INDEX_WORD_BITS + CTZ(bits);
+    }
+
+    /* nothing left in this word, use the summary to find the next non empty word */
+    if (word + 1 >= VSPACE_INDEX_WORDS) {
+        return VSPACE_LEVEL_SIZE;
+    }
+    summary &= ~0u << (word + 1);
+    if (summary == 0) {
+        return VSPACE_LEVEL_SIZE;
+    }
+
+    word = CTZ(summary);
+    return word * VSPACE_INDEX_WORD_BITS + CTZ(words[word]);
+}
+
+static inline void
+free_index_init(sel4utils_free_index_t *index)
+{
+    memset(index, 0, sizeof(*index));
+    /* everything starts out free */
+    for (uint32_t i = 0; i < VSPACE_LEVEL_SIZE; i++) {
+        free_index_set(index->has_free, &index->has_free_summary, i);
+    }
+}
+
+/* an entry in bottom level 'level' went from empty to non empty */
+static inline void
+free_index_take(sel4utils_free_index_t *index, uint32_t level)
+{
+    assert(index->used[level] < VSPACE_LEVEL_SIZE);
+    if (index->used[level] == 0) {
+        free_index_set(index->has_used, &index->has_used_summary, level);
+    }
+    index->used[level]++;
+    if (index->used[level] == VSPACE_LEVEL_SIZE) {
+        free_index_unset(index->has_free, &index->has_free_summary, level);
+    }
+}
+
+/* an entry in bottom level 'level' went from non empty to empty */
+static inline void
+free_index_release(sel4utils_free_index_t *index, uint32_t level)
+{
+    assert(index->used[level] > 0);
+    if (index->used[level] == VSPACE_LEVEL_SIZE) {
+        free_index_set(index->has_free, &index->has_free_summary, level);
+    }
+    index->used[level]--;
+    if (index->used[level] == 0) {
+        free_index_unset(index->has_used, &index->has_used_summary, level);
+    }
+}
+
+/* overwrite the number of used entries in bottom level 'level' */
+static inline void
+free_index_set_used(sel4utils_free_index_t *index, uint32_t level, uint32_t used)
+{
+    assert(used <= VSPACE_LEVEL_SIZE);
+    index->used[level] = used;
+
+    if (used == 0) {
+        free_index_unset(index->has_used, &index->has_used_summary, level);
+    } else {
+        free_index_set(index->has_used, &index->has_used_summary, level);
+    }
+
+    if (used == VSPACE_LEVEL_SIZE) {
+        free_index_unset(index->has_free, &index->has_free_summary, level);
+    } else {
+        free_index_set(index->has_free, &index->has_free_summary, level);
+    }
+}
+
 static inline int
 update_entry(vspace_t *vspace, void *vaddr, seL4_CPtr page, uint32_t cookie)
 {
@@ -69,6 +205,16 @@ update_entry(vspace_t *vspace, void *vaddr, seL4_CPtr page, uint32_t cookie)
 
     assert(data->top_level[TOP_LEVEL_INDEX(vaddr)] != (void *) RESERVED);
     assert(data->top_level[TOP_LEVEL_INDEX(vaddr)] != NULL);
+    assert(!is_large_level(data->top_level[TOP_LEVEL_INDEX(vaddr)]));
+
+    /* keep the free index in sync with the entry we are about to overwrite */
+    seL4_CPtr old = data->top_level[TOP_LEVEL_INDEX(vaddr)]->bottom_level[BOTTOM_LEVEL_INDEX(vaddr)];
+    if (old == 0 && page != 0) {
+        free_index_take(&data->free_index, TOP_LEVEL_INDEX(vaddr));
+    } else if (old != 0 && page == 0) {
+        free_index_release(&data->free_index, TOP_LEVEL_INDEX(vaddr));
+    }
+
     data->top_level[TOP_LEVEL_INDEX(vaddr)]->bottom_level[BOTTOM_LEVEL_INDEX(vaddr)] = page;
     data->top_level[TOP_LEVEL_INDEX(vaddr)]->cookies[BOTTOM_LEVEL_INDEX(vaddr)] = cookie;
 
@@ -113,30 +259,47 @@ clear(vspace_t *vspace, void *vaddr)
 static inline seL4_CPtr
 get_cap(bottom_level_t *top[], void *vaddr)
 {
-    if (top[TOP_LEVEL_INDEX(vaddr)] == NULL) {
+    bottom_level_t *level = top[TOP_LEVEL_INDEX(vaddr)];
+
+    if (level == NULL) {
         return 0;
     }
 
-    return top[TOP_LEVEL_INDEX(vaddr)]->bottom_level[BOTTOM_LEVEL_INDEX(vaddr)];
+    if (is_large_level(level)) {
+        return to_large_level(level)->cap;
+    }
+
+    return level->bottom_level[BOTTOM_LEVEL_INDEX(vaddr)];
 }
 
 static inline uint32_t
 get_cookie(bottom_level_t *top[], void *vaddr)
 {
+    bottom_level_t *level = top[TOP_LEVEL_INDEX(vaddr)];
 
-    if (top[TOP_LEVEL_INDEX(vaddr)] == NULL) {
+    if (level == NULL) {
         return 0;
     }
 
-    return top[TOP_LEVEL_INDEX(vaddr)]->cookies[BOTTOM_LEVEL_INDEX(vaddr)];
+    if (is_large_level(level)) {
+        return to_large_level(level)->cookie;
+    }
+
+    return level->cookies[BOTTOM_LEVEL_INDEX(vaddr)];
 }
 
 /* update entry in page table and handle large pages */
 static inline int
 update_entries(vspace_t *vspace, void *vaddr, seL4_CPtr cap, size_t size_bits, uint32_t cookie)
 {
+    /* frames covering whole bottom levels are recorded once per level */
+    if (size_bits >= TOP_LEVEL_BITS_OFFSET &&
+            large_level_map(vspace, vaddr, cap, size_bits, cookie) == seL4_NoError) {
+        return seL4_NoError;
+    }
+
     int error = seL4_NoError;
-    for (int i = 0; i < (1 << size_bits) && error == seL4_NoError; i += PAGE_SIZE_4K) {
+    for (uintptr_t i = 0; i < BIT(size_bits) && error == seL4_NoError; i += PAGE_SIZE_4K) {
         error = update(vspace, vaddr + i, cap, cookie);
     }
 
@@ -147,8 +310,20 @@ update_entries(vspace_t *vspace, void *vaddr, seL4_CPtr cap, size_t size_bits, u
 static inline int
 reserve_entries(vspace_t *vspace, void *vaddr, size_t size_bits)
 {
+    sel4utils_alloc_data_t *data = get_alloc_data(vspace);
     int error = seL4_NoError;
-    for (int i = 0; i < (1 << size_bits) && error == seL4_NoError; i += PAGE_SIZE_4K) {
+
+    for (uintptr_t i = 0; i < BIT(size_bits) && error == seL4_NoError; i += PAGE_SIZE_4K) {
+        uint32_t level = TOP_LEVEL_INDEX(vaddr + i);
+        if (is_large_level(data->top_level[level])) {
+            assert(BOTTOM_LEVEL_INDEX(vaddr + i) == 0);
+            large_level_release(vspace, vaddr + i);
+            if (data->free_index.used[level] == VSPACE_LEVEL_SIZE) {
+                /* the level we put back is still entirely reserved */
+                i += BYTES_PER_LEVEL - PAGE_SIZE_4K;
+                continue;
+            }
+        }
         error = reserve(vspace, vaddr + i);
     }
 
@@ -159,8 +334,23 @@ reserve_entries(vspace_t *vspace, void *vaddr, size_t size_bits)
 static inline void
 clear_entries(vspace_t *vspace, void *vaddr, size_t size_bits)
 {
+    sel4utils_alloc_data_t *data = get_alloc_data(vspace);
+
     assert( ((uintptr_t)vaddr & ((1 << size_bits) - 1)) == 0);
-    for (int i = 0; i < (1 << size_bits); i += PAGE_SIZE_4K) {
+    for (uintptr_t i = 0; i < BIT(size_bits); i += PAGE_SIZE_4K) {
+        uint32_t level = TOP_LEVEL_INDEX(vaddr + i);
+        if (is_large_level(data->top_level[level])) {
+            assert(BOTTOM_LEVEL_INDEX(vaddr + i) == 0);
+            large_level_release(vspace, vaddr + i);
+            if (data->free_index.used[level] == 0) {
+                /* the level we put back was empty, so there is nothing left to clear */
+                if (vaddr + i < data->last_allocated) {
+                    data->last_allocated = vaddr + i;
+                }
+                i += BYTES_PER_LEVEL - PAGE_SIZE_4K;
+                continue;
+            }
+        }
         clear(vspace, vaddr + i);
     }
 }
@@ -174,6 +364,8 @@ is_available(bottom_level_t *top_level[VSPACE_LEVEL_SIZE], void *vaddr)
         /* otherwise check the entry explicitly */
     } else if (top_level[TOP_LEVEL_INDEX(vaddr)] == (void *) RESERVED) {
         return 0;
+    } else if (is_large_level(top_level[TOP_LEVEL_INDEX(vaddr)])) {
+        return 0;
     }
 
     return top_level[TOP_LEVEL_INDEX(vaddr)]->bottom_level[BOTTOM_LEVEL_INDEX(vaddr)] == 0;
@@ -186,7 +378,8 @@ is_reserved(bottom_level_t *top_level[VSPACE_LEVEL_SIZE], void *vaddr)
         return 1;
     }
 
-    if (top_level[TOP_LEVEL_INDEX(vaddr)] == NULL) {
+    if (top_level[TOP_LEVEL_INDEX(vaddr)] == NULL ||
+            is_large_level(top_level[TOP_LEVEL_INDEX(vaddr)])) {
         return 0;
     }
 
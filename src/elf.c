@@ -11,6 +11,7 @@
 
 #if (defined CONFIG_LIB_SEL4_VKA && defined CONFIG_LIB_SEL4_VSPACE)
 
+#include <stdlib.h>
 #include <string.h>
 #include <sel4/sel4.h>
 #include <elf/elf.h>
@@ -19,7 +20,10 @@
 #include <sel4utils/thread.h>
 #include <sel4utils/util.h>
 #include <sel4utils/mapping.h>
+#include <sel4utils/vspace.h>
+#include <sel4utils/vspace_internal.h>
 #include <sel4utils/elf.h>
+#include "helpers.h"
 
 #ifdef CONFIG_X86_64
 #define SZFMT   "%ld"
@@ -30,6 +34,193 @@
 /* This library works with our cpio set up in the build system */
 extern char _cpio_archive[];
 
+/* images loaded by sel4utils_elf_image_cache_get, in no particular order */
+static sel4utils_elf_image_t *image_cache = NULL;
+static sel4utils_lock_t image_cache_lock;
+
+/* options for load_segment */
+#define LOAD_LARGE_FRAMES BIT(0)
+#define LOAD_LAZY_BSS     BIT(1)
+#define LOAD_EXECUTABLE   BIT(2)
+
+/* number of hash buckets in the index of the cpio archive */
+#define CPIO_INDEX_BUCKETS 64
+
+/* a PT_LOAD segment of an elf file */
+typedef struct elf_segment {
+    char *source;
+    unsigned long file_size;
+    unsigned long segment_size;
+    unsigned long vaddr;
+    unsigned long flags;
+} elf_segment_t;
+
+/* a file in the cpio archive, and what we need from its elf headers once it is parsed */
+typedef struct elf_info {
+    const char *name;
+    char *file;
+    unsigned long size;
+    int parsed;
+    int num_segments;
+    elf_segment_t *segments;
+    uint64_t entry_point;
+    uintptr_t vsyscall;
+    struct elf_info *next;
+} elf_info_t;
+
+/* index of the cpio archive by file name, built on first use. cpio_lock protects the
+ * index and parsing the entries in it */
+static elf_info_t *cpio_index[CPIO_INDEX_BUCKETS];
+static int cpio_indexed = 0;
+static sel4utils_lock_t cpio_lock;
+
+static uint32_t
+hash_name(const char *name)
+{
+    uint32_t hash = 5381;
+
+    while (*name != '\0') {
+        hash = hash * 33 + (unsigned char) *name++;
+    }
+
+    return hash % CPIO_INDEX_BUCKETS;
+}
+
+/* walk the archive headers once, rather than asking libcpio for each entry by number,
+ * which walks from the start of the archive every time. Called with cpio_lock held */
+static int
+index_cpio_archive(void)
+{
+    struct cpio_header *header = (struct cpio_header *) _cpio_archive;
+
+    while (1) {
+        const char *name;
+        unsigned long size;
+        void *file;
+        struct cpio_header *next;
+        int error = cpio_parse_header(header, &name, &size, &file, &next);
+        if (error == 1) {
+            /* the trailer */
+            break;
+        } else if (error) {
+            LOG_ERROR("Bad cpio header at %p", header);
+            break;
+        }
+        header = next;
+
+        elf_info_t *info = calloc(1, sizeof(elf_info_t));
+        if (info == NULL) {
+            LOG_ERROR("Failed to allocate cpio index entry");
+            /* throw away the partial index, we will try again next time */
+            for (int i = 0; i < CPIO_INDEX_BUCKETS; i++) {
+                while (cpio_index[i] != NULL) {
+                    elf_info_t *next_info = cpio_index[i]->next;
+                    free(cpio_index[i]);
+                    cpio_index[i] = next_info;
+                }
+            }
+            return -1;
+        }
+        info->name = name;
+        info->file = file;
+        info->size = size;
+        uint32_t bucket = hash_name(name);
+        info->next = cpio_index[bucket];
+        cpio_index[bucket] = info;
+    }
+
+    cpio_indexed = 1;
+    return 0;
+}
+
+static int
+parse_elf_info(elf_info_t *info)
+{
+    int num_headers = elf_getNumProgramHeaders(info->file);
+
+    for (int i = 0; i < num_headers; i++) {
+        /* Skip non-loadable segments (such as debugging data). */
+        if (elf_getProgramHeaderType(info->file, i) == PT_LOAD) {
+            info->num_segments++;
+        }
+    }
+
+    info->segments = calloc(info->num_segments, sizeof(elf_segment_t));
+    if (info->num_segments > 0 && info->segments == NULL) {
+        LOG_ERROR("Failed to allocate elf segment information");
+        info->num_segments = 0;
+        return -1;
+    }
+
+    for (int i = 0, segment = 0; i < num_headers; i++) {
+        if (elf_getProgramHeaderType(info->file, i) == PT_LOAD) {
+            elf_segment_t *seg = &info->segments[segment++];
+            seg->source = info->file + elf_getProgramHeaderOffset(info->file, i);
+            seg->file_size = elf_getProgramHeaderFileSize(info->file, i);
+            seg->segment_size = elf_getProgramHeaderMemorySize(info->file, i);
+            seg->vaddr = elf_getProgramHeaderVaddr(info->file, i);
+            seg->flags = elf_getProgramHeaderFlags(info->file, i);
+        }
+    }
+
+    info->entry_point = elf_getEntryPoint(info->file);
+
+    /* See if we can find the __vsyscall section */
+    void *addr = elf_getSectionNamed(info->file, "__vsyscall");
+    if (addr) {
+        /* Hope everyting is good and just dereference it */
+        info->vsyscall = *(uintptr_t*)addr;
+    }
+
+    info->parsed = 1;
+    return 0;
+}
+
+/* find a file in the cpio archive, indexing it the first time. Called with cpio_lock held */
+static elf_info_t *
+lookup_cpio_entry(const char *name)
+{
+    if (!cpio_indexed && index_cpio_archive() != 0) {
+        return NULL;
+    }
+
+    elf_info_t *info = cpio_index[hash_name(name)];
+    while (info != NULL && strcmp(info->name, name) != 0) {
+        info = info->next;
+    }
+
+    return info;
+}
+
+static elf_info_t *
+find_cpio_entry(const char *name)
+{
+    sel4utils_lock(&cpio_lock);
+    elf_info_t *info = lookup_cpio_entry(name);
+    sel4utils_unlock(&cpio_lock);
+
+    return info;
+}
+
+/*
+ * Find an elf file in the cpio archive and parse its headers, without walking the archive
+ * or parsing the file again on later calls.
+ *
+ * @return the information for image_name, NULL if it is not in the archive
+ */
+static elf_info_t *
+get_elf_info(const char *image_name)
+{
+    sel4utils_lock(&cpio_lock);
+    elf_info_t *info = lookup_cpio_entry(image_name);
+    if (info != NULL && !info->parsed && parse_elf_info(info) != 0) {
+        info = NULL;
+    }
+    sel4utils_unlock(&cpio_lock);
+
+    return info;
+}
+
 /*
  * Convert ELF permissions into seL4 permissions.
  *
@@ -52,11 +243,60 @@ rights_from_elf(unsigned long permissions)
     return result;
 }
 
+/*
+ * Allocate and map frames over [vaddr, end) of a segment, using the largest frames that fit
+ * where the alignment allows it if large_frames is set.
+ */
+static int
+new_segment_frames(vspace_t *loadee_vspace, void *vaddr, void *end, reservation_t reservation,
+                   int large_frames)
+{
+    while (vaddr < end) {
+        int i = 0;
+        if (large_frames) {
+            for (i = NUM_SEL4_PAGE_SIZES - 1; i > 0; i--) {
+                size_t size = BIT(sel4_supported_page_sizes[i]);
+                if (IS_ALIGNED((seL4_Word) vaddr, sel4_supported_page_sizes[i]) && vaddr + size <= end &&
+                        vaddr + size > vaddr) {
+                    break;
+                }
+            }
+        }
+        size_t size_bits = sel4_supported_page_sizes[i];
+
+        /* as many frames of this size as fit, stopping small frames where a bigger one
+         * could start */
+        void *limit = end;
+        if (large_frames && i + 1 < NUM_SEL4_PAGE_SIZES) {
+            void *next = (void *) ROUND_UP((seL4_Word) vaddr + 1, BIT(sel4_supported_page_sizes[i + 1]));
+            if (next > vaddr && next < limit) {
+                limit = next;
+            }
+        }
+        size_t num_pages = (limit - vaddr) >> size_bits;
+
+        int error = vspace_new_pages_at_vaddr(loadee_vspace, vaddr, num_pages, size_bits, reservation);
+        if (error != seL4_NoError && size_bits != seL4_PageBits) {
+            /* no large frames available, use small ones for the rest */
+            large_frames = 0;
+            continue;
+        }
+        if (error != seL4_NoError) {
+            LOG_ERROR("ERROR: failed to allocate frames by loadee vka: %d", error);
+            return error;
+        }
+
+        vaddr += num_pages << size_bits;
+    }
+
+    return seL4_NoError;
+}
+
 static int
 load_segment(vspace_t *loadee_vspace, vspace_t *loader_vspace,
              vka_t *loadee_vka, vka_t *loader_vka,
              char *src, size_t segment_size, size_t file_size, uint32_t dst,
-             reservation_t reservation)
+             reservation_t reservation, int load_flags)
 {
     int error = seL4_NoError;
 
@@ -65,74 +305,31 @@ load_segment(vspace_t *loadee_vspace, vspace_t *loader_vspace,
         return seL4_InvalidArgument;
     }
 
-    /* create a slot to map a page into the loader address space */
-    seL4_CPtr loader_slot;
-    cspacepath_t loader_frame_cap;
-
-    error = vka_cspace_alloc(loader_vka, &loader_slot);
-    if (error) {
-        LOG_ERROR("Failed to allocate cslot by loader vka: %d", error);
+    /* create and map the frames of the segment in the loadee address space. Pages with no
+     * file data in them are only zeroes, so with lazy bss they are left to the fault
+     * handler and never touched here */
+    void *start = (void *) (seL4_Word) ROUND_DOWN(dst, PAGE_SIZE_4K);
+    size_t size = (load_flags & LOAD_LAZY_BSS) ? file_size : segment_size;
+    void *end = (void *) (seL4_Word) ROUND_UP(dst + size, PAGE_SIZE_4K);
+    error = new_segment_frames(loadee_vspace, start, end, reservation,
+                               load_flags & LOAD_LARGE_FRAMES);
+    if (error != seL4_NoError) {
         return error;
     }
-    vka_cspace_make_path(loader_vka, loader_slot, &loader_frame_cap);
-
-    /* We work a page at a time */
-    unsigned int pos = 0;
-    while (pos < segment_size && error == seL4_NoError) {
-        void *loader_vaddr = 0;
-        void *loadee_vaddr = (void *) ((seL4_Word)ROUND_DOWN(dst, PAGE_SIZE_4K));
-
-        /* create and map the frame in the loadee address space */
-        error = vspace_new_pages_at_vaddr(loadee_vspace, loadee_vaddr, 1, seL4_PageBits, reservation);
-        if (error != seL4_NoError) {
-            LOG_ERROR("ERROR: failed to allocate frame by loadee vka: %d", error);
-            continue;
-        }
-
-        /* copy the frame cap to map into the loader address space */
-        cspacepath_t loadee_frame_cap;
-
-        vka_cspace_make_path(loadee_vka, vspace_get_cap(loadee_vspace, loadee_vaddr),
-                             &loadee_frame_cap);
-        error = vka_cnode_copy(&loader_frame_cap, &loadee_frame_cap, seL4_AllRights);
-        if (error != seL4_NoError) {
-            LOG_ERROR("ERROR: failed to copy frame cap into loader cspace: %d", error);
-            continue;
-        }
 
-        /* map the frame into the loader address space */
-        loader_vaddr = vspace_map_pages(loader_vspace, &loader_frame_cap.capPtr, NULL, seL4_AllRights,
-                                        1, seL4_PageBits, 1);
-        if (loader_vaddr == NULL) {
-            LOG_ERROR("failed to map frame into loader vspace.");
-            error = -1;
-            continue;
-        }
-
-        /* finally copy the data */
-        int nbytes = PAGE_SIZE_4K - (dst & PAGE_MASK_4K);
-        if (pos < file_size) {
-            memcpy(loader_vaddr + (dst % PAGE_SIZE_4K), (void*)src, MIN(nbytes, file_size - pos));
-        }
-        /* Note that we don't need to explicitly zero frames as seL4 gives us zero'd frames */
-
-#ifdef CONFIG_ARCH_ARM
-        /* Flush the caches */
-        seL4_ARM_Page_Unify_Instruction(loader_frame_cap.capPtr, 0, PAGE_SIZE_4K);
-        seL4_ARM_Page_Unify_Instruction(loadee_frame_cap.capPtr, 0, PAGE_SIZE_4K);
-#endif /* CONFIG_ARCH_ARM */
-
-        /* now unmap the page in the loader address space */
-        vspace_unmap_pages(loader_vspace, (void *) loader_vaddr, 1, seL4_PageBits, VSPACE_PRESERVE);
-        vka_cnode_delete(&loader_frame_cap);
-
-        pos += nbytes;
-        dst += nbytes;
-        src += nbytes;
+    /* copy the data, mapping as many frames into the loader at once as we can.
+     * Note that we don't need to explicitly zero frames as seL4 gives us zero'd frames */
+    error = sel4utils_vspace_copy_vka(loader_vka, loader_vspace, loadee_vka, loadee_vspace,
+                                      (void *) (seL4_Word) dst, src, file_size);
+    if (error != seL4_NoError) {
+        LOG_ERROR("failed to copy segment into loadee vspace.");
+        return error;
     }
 
-    /* clear the cslot */
-    vka_cspace_free(loader_vka, loader_frame_cap.capPtr);
+    /* only code needs to reach the instruction cache */
+    if (load_flags & LOAD_EXECUTABLE) {
+        sel4utils_unify_instruction(loadee_vspace, (void *) (seL4_Word) dst, file_size);
+    }
 
     return error;
 }
@@ -140,34 +337,23 @@ load_segment(vspace_t *loadee_vspace, vspace_t *loader_vspace,
 int
 sel4utils_elf_num_regions(char *image_name)
 {
-    int i;
-    unsigned long elf_size;
-    char *elf_file;
     assert(image_name);
-    elf_file = cpio_get_file(_cpio_archive, image_name, &elf_size);
-    if (elf_file == NULL) {
+    elf_info_t *info = get_elf_info(image_name);
+    if (info == NULL) {
         LOG_ERROR("ERROR: failed to load elf file %s", image_name);
         return 0;
     }
 
-    int num_headers = elf_getNumProgramHeaders(elf_file);
-    int loadable_headers = 0;
-
-    for (i = 0; i < num_headers; i++) {
-        /* Skip non-loadable segments (such as debugging data). */
-        if (elf_getProgramHeaderType(elf_file, i) == PT_LOAD) {
-            loadable_headers++;
-        }
-    }
-    return loadable_headers;
+    return info->num_segments;
 }
 
 static int
 make_region(vspace_t *loadee, unsigned long flags, unsigned long segment_size,
-            unsigned long vaddr, sel4utils_elf_region_t *region, int anywhere)
+            unsigned long vaddr, sel4utils_elf_region_t *region, int anywhere, int lazy)
 {
     region->cacheable = 1;
     region->rights = rights_from_elf(flags);
+    region->executable = (flags & PF_X) != 0;
     region->elf_vstart = (void*)PAGE_ALIGN_4K(vaddr);
     region->size = PAGE_ALIGN_4K(vaddr + segment_size - 1) + PAGE_SIZE_4K - (uint32_t)((seL4_Word)region->elf_vstart);
 
@@ -176,11 +362,19 @@ make_region(vspace_t *loadee, unsigned long flags, unsigned long segment_size,
             region->reservation = vspace_reserve_range(loadee, region->size, region->rights, 1, (void**)&region->reservation_vstart);
         } else {
             region->reservation_vstart = region->elf_vstart;
-            region->reservation = vspace_reserve_range_at(loadee,
-                                                          region->elf_vstart,
-                                                          region->size,
-                                                          region->rights,
-                                                          1);
+            if (lazy) {
+                region->reservation = sel4utils_reserve_range_at_lazy(loadee, region->elf_vstart,
+                                                                      region->size, region->rights, 1);
+                if (region->reservation.res != NULL && region->executable) {
+                    sel4utils_set_executable(loadee, region->reservation);
+                }
+            } else {
+                region->reservation = vspace_reserve_range_at(loadee,
+                                                              region->elf_vstart,
+                                                              region->size,
+                                                              region->rights,
+                                                              1);
+            }
         }
         return !region->reservation.res;
     }
@@ -191,38 +385,25 @@ make_region(vspace_t *loadee, unsigned long flags, unsigned long segment_size,
 void *
 sel4utils_elf_reserve(vspace_t *loadee, char *image_name, sel4utils_elf_region_t *regions)
 {
-    unsigned long elf_size;
-    char *elf_file = cpio_get_file(_cpio_archive, image_name, &elf_size);
-    if (elf_file == NULL) {
+    elf_info_t *info = get_elf_info(image_name);
+    if (info == NULL) {
         LOG_ERROR("ERROR: failed to load elf file %s", image_name);
         return NULL;
     }
 
-    int num_headers = elf_getNumProgramHeaders(elf_file);
-    int region = 0;
-
-    for (int i = 0; i < num_headers; i++) {
-        unsigned long flags, segment_size, vaddr;
-
-        /* Skip non-loadable segments (such as debugging data). */
-        if (elf_getProgramHeaderType(elf_file, i) == PT_LOAD) {
-            /* Fetch information about this segment. */
-            segment_size = elf_getProgramHeaderMemorySize(elf_file, i);
-            vaddr = elf_getProgramHeaderVaddr(elf_file, i);
-            flags = elf_getProgramHeaderFlags(elf_file, i);
-            if (make_region(loadee, flags, segment_size, vaddr, &regions[region], 0)) {
-                for (region--; region >= 0; region--) {
-                    vspace_free_reservation(loadee, regions[region].reservation);
-                    regions[region].reservation.res = NULL;
-                }
-                LOG_ERROR("Failed to create reservation");
-                return NULL;
+    for (int region = 0; region < info->num_segments; region++) {
+        elf_segment_t *seg = &info->segments[region];
+        if (make_region(loadee, seg->flags, seg->segment_size, seg->vaddr, &regions[region], 0, 0)) {
+            for (region--; region >= 0; region--) {
+                vspace_free_reservation(loadee, regions[region].reservation);
+                regions[region].reservation.res = NULL;
             }
-            region++;
+            LOG_ERROR("Failed to create reservation");
+            return NULL;
         }
     }
 
-    uint64_t entry_point = elf_getEntryPoint(elf_file);
+    uint64_t entry_point = info->entry_point;
     if ((uint32_t) (entry_point >> 32) != 0) {
         LOG_ERROR("ERROR: this code hasn't been tested for 64bit!");
         return NULL;
@@ -231,85 +412,145 @@ sel4utils_elf_reserve(vspace_t *loadee, char *image_name, sel4utils_elf_region_t
     return (void*)(seL4_Word)entry_point;
 }
 
-void *
-sel4utils_elf_load_record_regions(vspace_t *loadee, vspace_t *loader, vka_t *loadee_vka, vka_t *loader_vka, char *image_name, sel4utils_elf_region_t *regions, int mapanywhere)
+static void *
+load_record_regions(vspace_t *loadee, vspace_t *loader, vka_t *loadee_vka, vka_t *loader_vka,
+                    char *image_name, sel4utils_elf_region_t *regions, int mapanywhere,
+                    int load_flags)
 {
-    unsigned long elf_size;
-    char *elf_file = cpio_get_file(_cpio_archive, image_name, &elf_size);
-    if (elf_file == NULL) {
+    elf_info_t *info = get_elf_info(image_name);
+    if (info == NULL) {
         LOG_ERROR("ERROR: failed to load elf file %s", image_name);
         return NULL;
     }
 
-    int num_headers = elf_getNumProgramHeaders(elf_file);
     int error = seL4_NoError;
-    int region_count = 0;
 
-    uint64_t entry_point = elf_getEntryPoint(elf_file);
+    uint64_t entry_point = info->entry_point;
     if ((uint32_t) (entry_point >> 32) != 0) {
         LOG_ERROR("ERROR: this code hasn't been tested for 64bit!");
         return NULL;
     }
     assert(entry_point != 0);
 
-    for (int i = 0; i < num_headers; i++) {
-        char *source_addr;
-        unsigned long flags, file_size, segment_size, vaddr;
+    for (int region_count = 0; region_count < info->num_segments; region_count++) {
+        elf_segment_t *seg = &info->segments[region_count];
+        /* make reservation */
+        sel4utils_elf_region_t region;
+        error = make_region(loadee, seg->flags, seg->segment_size, seg->vaddr, &region, mapanywhere,
+                            load_flags & LOAD_LAZY_BSS);
+        if (error) {
+            LOG_ERROR("Failed to reserve region");
+            break;
+        }
+        unsigned long offset = seg->vaddr - PAGE_ALIGN_4K(seg->vaddr);
+        /* Copy it across to the vspace */
+        LOG_INFO(" * Loading segment %08x-->%08x", (int)seg->vaddr, (int)(seg->vaddr + seg->segment_size));
+        error = load_segment(loadee, loader, loadee_vka, loader_vka, seg->source,
+                             seg->segment_size, seg->file_size, offset + (uint32_t)((seL4_Word)region.reservation_vstart), region.reservation,
+                             load_flags | ((seg->flags & PF_X) ? LOAD_EXECUTABLE : 0));
+        if (!error && (load_flags & LOAD_LAZY_BSS)) {
+            /* so the fault handler never has to allocate page tables */
+            error = sel4utils_prepare_range(loadee, region.reservation_vstart, region.size);
+        }
+        if (error) {
+            LOG_ERROR("Failed to load segment");
+            break;
+        }
+        /* record the region if requested */
+        if (regions) {
+            regions[region_count] = region;
+        } else {
+            vspace_free_reservation(loadee, region.reservation);
+        }
+    }
 
-        /* Skip non-loadable segments (such as debugging data). */
-        if (elf_getProgramHeaderType(elf_file, i) == PT_LOAD) {
-            /* Fetch information about this segment. */
-            source_addr = elf_file + elf_getProgramHeaderOffset(elf_file, i);
-            file_size = elf_getProgramHeaderFileSize(elf_file, i);
-            segment_size = elf_getProgramHeaderMemorySize(elf_file, i);
-            vaddr = elf_getProgramHeaderVaddr(elf_file, i);
-            flags = elf_getProgramHeaderFlags(elf_file, i);
-            /* make reservation */
-            sel4utils_elf_region_t region;
-            error = make_region(loadee, flags, segment_size, vaddr, &region, mapanywhere);
-            if (error) {
-                LOG_ERROR("Failed to reserve region");
-                break;
+    return error == seL4_NoError ? (void*)(seL4_Word)entry_point : NULL;
+}
+
+void *
+sel4utils_elf_load_record_regions(vspace_t *loadee, vspace_t *loader, vka_t *loadee_vka, vka_t *loader_vka, char *image_name, sel4utils_elf_region_t *regions, int mapanywhere)
+{
+    return load_record_regions(loadee, loader, loadee_vka, loader_vka, image_name, regions,
+                               mapanywhere, LOAD_LARGE_FRAMES);
+}
+
+void *
+sel4utils_elf_load_lazy_bss(vspace_t *loadee, vspace_t *loader, vka_t *loadee_vka, vka_t *loader_vka,
+                            char *image_name, sel4utils_elf_region_t *regions)
+{
+    assert(regions != NULL);
+    return load_record_regions(loadee, loader, loadee_vka, loader_vka, image_name, regions, 0,
+                               LOAD_LARGE_FRAMES | LOAD_LAZY_BSS);
+}
+
+void *
+sel4utils_elf_load_lazy(vspace_t *loadee, vspace_t *loader, char *image_name,
+                        sel4utils_elf_region_t *regions)
+{
+    assert(regions != NULL);
+
+    elf_info_t *info = get_elf_info(image_name);
+    if (info == NULL) {
+        LOG_ERROR("ERROR: failed to load elf file %s", image_name);
+        return NULL;
+    }
+
+    uint64_t entry_point = info->entry_point;
+    if ((uint32_t) (entry_point >> 32) != 0) {
+        LOG_ERROR("ERROR: this code hasn't been tested for 64bit!");
+        return NULL;
+    }
+    assert(entry_point != 0);
+
+    for (int region = 0; region < info->num_segments; region++) {
+        elf_segment_t *seg = &info->segments[region];
+        int error = make_region(loadee, seg->flags, seg->segment_size, seg->vaddr, &regions[region], 0, 1);
+        if (!error) {
+            error = sel4utils_set_lazy_source(loadee, regions[region].reservation, loader,
+                                              (void *) (seL4_Word) seg->vaddr, seg->source,
+                                              seg->file_size);
+            if (!error) {
+                /* so the fault handler never has to allocate page tables */
+                error = sel4utils_prepare_range(loadee, regions[region].elf_vstart,
+                                                regions[region].size);
             }
-            unsigned long offset = vaddr - PAGE_ALIGN_4K(vaddr);
-            /* Copy it across to the vspace */
-            LOG_INFO(" * Loading segment %08x-->%08x", (int)vaddr, (int)(vaddr + segment_size));
-            error = load_segment(loadee, loader, loadee_vka, loader_vka, source_addr,
-                                 segment_size, file_size, offset + (uint32_t)((seL4_Word)region.reservation_vstart), region.reservation);
             if (error) {
-                LOG_ERROR("Failed to load segment");
-                break;
+                region++;
             }
-            /* record the region if requested */
-            if (regions) {
-                regions[region_count] = region;
-            } else {
-                vspace_free_reservation(loadee, region.reservation);
+        }
+        if (error) {
+            for (region--; region >= 0; region--) {
+                vspace_free_reservation(loadee, regions[region].reservation);
+                regions[region].reservation.res = NULL;
             }
-            /* increment the count of the number of loaded regions */
-            region_count++;
+            LOG_ERROR("Failed to create reservation");
+            return NULL;
         }
     }
 
-    return error == seL4_NoError ? (void*)(seL4_Word)entry_point : NULL;
+    return (void*)(seL4_Word)entry_point;
+}
+
+char *
+sel4utils_cpio_get_file(const char *name, unsigned long *size)
+{
+    elf_info_t *info = find_cpio_entry(name);
+    if (info == NULL) {
+        return NULL;
+    }
+
+    *size = info->size;
+    return info->file;
 }
 
 uintptr_t sel4utils_elf_get_vsyscall(char *image_name)
 {
-    unsigned long elf_size;
-    char *elf_file = cpio_get_file(_cpio_archive, image_name, &elf_size);
-    if (elf_file == NULL) {
+    elf_info_t *info = get_elf_info(image_name);
+    if (info == NULL) {
         LOG_ERROR("ERROR: failed to lookup elf file %s", image_name);
         return 0;
     }
-    /* See if we can find the __vsyscall section */
-    void *addr = elf_getSectionNamed(elf_file, "__vsyscall");
-    if (addr) {
-        /* Hope everyting is good and just dereference it */
-        return *(uintptr_t*)addr;
-    } else {
-        return 0;
-    }
+    return info->vsyscall;
 }
 
 void *
@@ -318,4 +559,570 @@ sel4utils_elf_load(vspace_t *loadee, vspace_t *loader, vka_t *loadee_vka, vka_t
     return sel4utils_elf_load_record_regions(loadee, loader, loadee_vka, loader_vka, image_name, NULL, 0);
 }
 
+int
+sel4utils_elf_image_load(vspace_t *loader, vka_t *vka, char *image_name, sel4utils_elf_image_t *image)
+{
+    image->loader = loader;
+    image->vka = vka;
+    image->image_name = NULL;
+    image->next = NULL;
+    image->num_regions = sel4utils_elf_num_regions(image_name);
+    if (image->num_regions == 0) {
+        return -1;
+    }
+
+    image->regions = calloc(image->num_regions, sizeof(*image->regions));
+    if (image->regions == NULL) {
+        LOG_ERROR("Failed to allocate memory for elf region information");
+        return -1;
+    }
+
+    /* images are shared a 4K page at a time, so they must be loaded into 4K frames */
+    image->entry_point = load_record_regions(loader, loader, vka, vka, image_name,
+                                             image->regions, 1, 0);
+    if (image->entry_point == NULL) {
+        /* regions that were loaded before the failure are still recorded */
+        sel4utils_elf_image_free(image);
+        return -1;
+    }
+
+    return 0;
+}
+
+void
+sel4utils_elf_image_free(sel4utils_elf_image_t *image)
+{
+    for (int i = 0; i < image->num_regions; i++) {
+        sel4utils_elf_region_t *region = &image->regions[i];
+        if (region->reservation.res == NULL) {
+            continue;
+        }
+        for (uint32_t offset = 0; offset < region->size; offset += PAGE_SIZE_4K) {
+            void *vaddr = region->reservation_vstart + offset;
+            if (vspace_get_cap(image->loader, vaddr) != 0) {
+                vspace_unmap_pages(image->loader, vaddr, 1, seL4_PageBits, image->vka);
+            }
+        }
+        vspace_free_reservation(image->loader, region->reservation);
+    }
+
+    free(image->regions);
+    image->regions = NULL;
+    image->num_regions = 0;
+}
+
+static int
+share_page(sel4utils_elf_image_t *image, void *master, vspace_t *loadee, vka_t *loadee_vka,
+           void *vaddr, reservation_t reservation)
+{
+    seL4_CPtr slot;
+    cspacepath_t src, dest;
+
+    int error = vka_cspace_alloc(loadee_vka, &slot);
+    if (error) {
+        LOG_ERROR("Failed to allocate cslot by loadee vka: %d", error);
+        return error;
+    }
+
+    vka_cspace_make_path(image->vka, vspace_get_cap(image->loader, master), &src);
+    vka_cspace_make_path(loadee_vka, slot, &dest);
+    error = vka_cnode_copy(&dest, &src, seL4_AllRights);
+    if (error) {
+        LOG_ERROR("Failed to copy frame cap into loadee cspace: %d", error);
+        vka_cspace_free(loadee_vka, slot);
+        return error;
+    }
+
+    /* no cookie, the frame still belongs to the image */
+    error = vspace_map_pages_at_vaddr(loadee, &slot, NULL, vaddr, 1, seL4_PageBits, reservation);
+    if (error) {
+        LOG_ERROR("Failed to map shared frame at %p", vaddr);
+        vka_cnode_delete(&dest);
+        vka_cspace_free(loadee_vka, slot);
+    }
+
+    return error;
+}
+
+/* reserve region i of image at its elf address in loadee and map the master frames into it */
+static int
+share_region(sel4utils_elf_image_t *image, int i, vspace_t *loadee, vka_t *loadee_vka,
+             sel4utils_elf_region_t *region, int cow)
+{
+    *region = image->regions[i];
+    region->reservation_vstart = region->elf_vstart;
+
+    if (cow) {
+        region->reservation = sel4utils_reserve_range_at_cow(loadee, region->elf_vstart,
+                                                             region->size, region->rights, 1);
+    } else {
+        region->reservation = vspace_reserve_range_at(loadee, region->elf_vstart,
+                                                      region->size, region->rights, 1);
+    }
+
+    if (region->reservation.res == NULL) {
+        LOG_ERROR("Failed to reserve region");
+        return -1;
+    }
+    if (region->executable) {
+        sel4utils_set_executable(loadee, region->reservation);
+    }
+
+    for (uint32_t offset = 0; offset < region->size; offset += PAGE_SIZE_4K) {
+        void *master = image->regions[i].reservation_vstart + offset;
+        if (share_page(image, master, loadee, loadee_vka, region->elf_vstart + offset,
+                       region->reservation) != 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void *
+sel4utils_elf_image_share(sel4utils_elf_image_t *image, vspace_t *loadee, vka_t *loadee_vka,
+                          sel4utils_elf_region_t *regions)
+{
+    for (int i = 0; i < image->num_regions; i++) {
+        int cow = (image->regions[i].rights & seL4_CanWrite) != 0;
+        if (share_region(image, i, loadee, loadee_vka, &regions[i], cow) != 0) {
+            sel4utils_elf_image_unshare(loadee, loadee_vka, regions, i + 1);
+            return NULL;
+        }
+    }
+
+    return image->entry_point;
+}
+
+void *
+sel4utils_elf_load_shared(sel4utils_elf_image_t *image, vspace_t *loadee, vspace_t *loader,
+                          vka_t *loadee_vka, vka_t *loader_vka, sel4utils_elf_region_t *regions)
+{
+    for (int i = 0; i < image->num_regions; i++) {
+        sel4utils_elf_region_t *region = &regions[i];
+        int error;
+
+        if (image->regions[i].rights & seL4_CanWrite) {
+            /* writable segments get a private copy, taken from the master copy rather
+             * than the cpio archive so relocating and zeroing is already done */
+            *region = image->regions[i];
+            region->reservation_vstart = region->elf_vstart;
+            region->reservation = vspace_reserve_range_at(loadee, region->elf_vstart, region->size,
+                                                          region->rights, 1);
+            error = region->reservation.res == NULL;
+            if (!error) {
+                error = load_segment(loadee, loader, loadee_vka, loader_vka,
+                                     image->regions[i].reservation_vstart, region->size,
+                                     region->size, (uint32_t) (seL4_Word) region->elf_vstart,
+                                     region->reservation, LOAD_LARGE_FRAMES);
+            }
+        } else {
+            error = share_region(image, i, loadee, loadee_vka, region, 0);
+        }
+
+        if (error) {
+            LOG_ERROR("Failed to load region %d", i);
+            sel4utils_elf_image_unshare(loadee, loadee_vka, regions, i + 1);
+            return NULL;
+        }
+    }
+
+    return image->entry_point;
+}
+
+/* called with image_cache_lock held */
+static sel4utils_elf_image_t *
+find_cached_image(vspace_t *loader, const char *image_name)
+{
+    sel4utils_elf_image_t *image;
+
+    for (image = image_cache; image != NULL; image = image->next) {
+        if (image->loader == loader && strcmp(image->image_name, image_name) == 0) {
+            break;
+        }
+    }
+
+    return image;
+}
+
+sel4utils_elf_image_t *
+sel4utils_elf_image_cache_get(vspace_t *loader, vka_t *vka, char *image_name)
+{
+    sel4utils_lock(&image_cache_lock);
+    sel4utils_elf_image_t *image = find_cached_image(loader, image_name);
+    sel4utils_unlock(&image_cache_lock);
+    if (image != NULL) {
+        return image;
+    }
+
+    /* load without the lock held, it takes a while */
+    image = malloc(sizeof(sel4utils_elf_image_t));
+    if (image == NULL) {
+        LOG_ERROR("Failed to allocate image cache entry");
+        return NULL;
+    }
+
+    if (sel4utils_elf_image_load(loader, vka, image_name, image) != 0) {
+        LOG_ERROR("Failed to load %s into the image cache", image_name);
+        free(image);
+        return NULL;
+    }
+
+    /* the index entry's name lives as long as the archive, unlike the caller's */
+    image->image_name = get_elf_info(image_name)->name;
+
+    /* someone else may have loaded the same image meanwhile, keep theirs */
+    sel4utils_lock(&image_cache_lock);
+    sel4utils_elf_image_t *cached = find_cached_image(loader, image_name);
+    if (cached == NULL) {
+        image->next = image_cache;
+        image_cache = image;
+    }
+    sel4utils_unlock(&image_cache_lock);
+
+    if (cached != NULL) {
+        sel4utils_elf_image_free(image);
+        free(image);
+        return cached;
+    }
+
+    return image;
+}
+
+void
+sel4utils_elf_image_cache_flush(vspace_t *loader)
+{
+    sel4utils_elf_image_t *flushed = NULL;
+
+    sel4utils_lock(&image_cache_lock);
+    sel4utils_elf_image_t **prev = &image_cache;
+    while (*prev != NULL) {
+        sel4utils_elf_image_t *image = *prev;
+        if (image->loader == loader) {
+            *prev = image->next;
+            image->next = flushed;
+            flushed = image;
+        } else {
+            prev = &image->next;
+        }
+    }
+    sel4utils_unlock(&image_cache_lock);
+
+    while (flushed != NULL) {
+        sel4utils_elf_image_t *image = flushed;
+        flushed = image->next;
+        sel4utils_elf_image_free(image);
+        free(image);
+    }
+}
+
+void
+sel4utils_elf_image_unshare(vspace_t *loadee, vka_t *loadee_vka, sel4utils_elf_region_t *regions,
+                            int num_regions)
+{
+    for (int i = 0; i < num_regions; i++) {
+        sel4utils_elf_region_t *region = &regions[i];
+        if (region->reservation.res == NULL) {
+            continue;
+        }
+        for (uint32_t offset = 0; offset < region->size; offset += PAGE_SIZE_4K) {
+            void *vaddr = region->reservation_vstart + offset;
+            seL4_CPtr cap = vspace_get_cap(loadee, vaddr);
+            /* private copies made on write have a cookie */
+            if (cap == 0 || vspace_get_cookie(loadee, vaddr) != 0) {
+                continue;
+            }
+            cspacepath_t path;
+            vspace_unmap_pages(loadee, vaddr, 1, seL4_PageBits, VSPACE_PRESERVE);
+            vka_cspace_make_path(loadee_vka, cap, &path);
+            vka_cnode_delete(&path);
+            vka_cspace_free(loadee_vka, cap);
+        }
+        vspace_free_reservation(loadee, region->reservation);
+        region->reservation.res = NULL;
+    }
+}
+
+/*
+ * Copy into a range of the loadee through a worker's window. Only system calls are made, so
+ * workers can do this at the same time.
+ */
+static int
+worker_copy(sel4utils_elf_loader_worker_t *worker, char *src, void *dst, size_t len)
+{
+    sel4utils_elf_loader_t *loader = worker->loader;
+
+    while (len > 0) {
+        void *page = (void *) PAGE_ALIGN_4K((seL4_Word) dst);
+        size_t offset = dst - page;
+        uint32_t num_pages = MIN(BYTES_TO_4K_PAGES(offset + len), SEL4UTILS_MAP_WINDOW_MAX_PAGES);
+        int error = seL4_NoError;
+        uint32_t mapped;
+
+        for (mapped = 0; mapped < num_pages && error == seL4_NoError; mapped++) {
+            cspacepath_t src_path, dest_path;
+            vka_cspace_make_path(loader->loadee_vka,
+                                 vspace_get_cap(loader->loadee, page + mapped * PAGE_SIZE_4K), &src_path);
+            vka_cspace_make_path(loader->vka, worker->slots[mapped], &dest_path);
+            error = vka_cnode_copy(&dest_path, &src_path, seL4_AllRights);
+            if (error == seL4_NoError) {
+                error = seL4_ARCH_Page_Map(worker->slots[mapped], loader->page_directory,
+                                           (seL4_Word) worker->window + mapped * PAGE_SIZE_4K,
+                                           seL4_AllRights, seL4_ARCH_Default_VMAttributes);
+                if (error != seL4_NoError) {
+                    vka_cnode_delete(&dest_path);
+                }
+            }
+        }
+        if (error != seL4_NoError) {
+            mapped--;
+        }
+
+        size_t nbytes = MIN(len, num_pages * PAGE_SIZE_4K - offset);
+        if (error == seL4_NoError) {
+            memcpy(worker->window + offset, src, nbytes);
+        }
+
+        for (uint32_t i = 0; i < mapped; i++) {
+            cspacepath_t path;
+            seL4_ARCH_Page_Unmap(worker->slots[i]);
+            vka_cspace_make_path(loader->vka, worker->slots[i], &path);
+            vka_cnode_delete(&path);
+        }
+
+        if (error != seL4_NoError) {
+            return -1;
+        }
+
+        src += nbytes;
+        dst += nbytes;
+        len -= nbytes;
+    }
+
+    return 0;
+}
+
+/* the page aligned point in [dst, dst + len] where worker k's share of a segment starts */
+static void *
+worker_share(void *dst, size_t len, int k, int num_workers)
+{
+    if (k == 0) {
+        return dst;
+    } else if (k == num_workers) {
+        return dst + len;
+    }
+    void *point = dst + (size_t) (((uint64_t) len * k) / num_workers);
+    return MAX(dst, (void *) PAGE_ALIGN_4K((seL4_Word) point));
+}
+
+static void
+loader_worker(sel4utils_elf_loader_worker_t *worker)
+{
+    sel4utils_elf_loader_t *loader = worker->loader;
+
+    while (1) {
+        seL4_Wait(worker->start.cptr, NULL);
+
+        elf_info_t *info = loader->image;
+        int error = 0;
+        for (int i = 0; i < info->num_segments && !error; i++) {
+            elf_segment_t *seg = &info->segments[i];
+            void *dst = (void *) (seL4_Word) seg->vaddr;
+            void *from = worker_share(dst, seg->file_size, worker->index, loader->num_workers);
+            void *to = worker_share(dst, seg->file_size, worker->index + 1, loader->num_workers);
+            if (to > from) {
+                error = worker_copy(worker, seg->source + (from - dst), from, to - from);
+            }
+        }
+
+        worker->error = error;
+        __sync_synchronize();
+        worker->done = 1;
+        seL4_Notify(loader->done.cptr, 0);
+    }
+}
+
+int
+sel4utils_elf_loader_create(sel4utils_elf_loader_t *loader, vka_t *vka, vspace_t *vspace,
+                            int num_workers, sel4utils_thread_config_t config)
+{
+    assert(num_workers > 0 && num_workers <= SEL4UTILS_ELF_LOADER_MAX_WORKERS);
+
+    memset(loader, 0, sizeof(*loader));
+    loader->vspace = vspace;
+    loader->vka = vka;
+    loader->page_directory = get_alloc_data(vspace)->page_directory;
+
+    if (vka_alloc_async_endpoint(vka, &loader->done) != 0) {
+        LOG_ERROR("Failed to allocate async endpoint for elf loader");
+        return -1;
+    }
+
+    for (loader->num_workers = 0; loader->num_workers < num_workers; loader->num_workers++) {
+        sel4utils_elf_loader_worker_t *worker = &loader->workers[loader->num_workers];
+        size_t window_size = SEL4UTILS_MAP_WINDOW_MAX_PAGES * PAGE_SIZE_4K;
+        int error;
+
+        worker->loader = loader;
+        worker->index = loader->num_workers;
+        worker->window_reservation = vspace_reserve_range(vspace, window_size, seL4_AllRights, 1,
+                                                          &worker->window);
+        error = worker->window_reservation.res == NULL;
+        if (!error) {
+            /* set up page tables now so that mapping into the window never needs them */
+            error = sel4utils_prepare_range(vspace, worker->window, window_size);
+        }
+        for (int i = 0; i < SEL4UTILS_MAP_WINDOW_MAX_PAGES && !error; i++) {
+            error = vka_cspace_alloc(vka, &worker->slots[i]);
+        }
+        if (!error) {
+            error = vka_alloc_async_endpoint(vka, &worker->start);
+        }
+        if (!error) {
+            error = sel4utils_configure_thread_config(vka, vspace, vspace, config, &worker->thread);
+        }
+        if (!error) {
+            error = sel4utils_start_thread(&worker->thread, loader_worker, worker, NULL, 1);
+        }
+
+        if (error) {
+            LOG_ERROR("Failed to create elf loader worker %d", worker->index);
+            /* count the partly created worker so that destroy cleans it up */
+            loader->num_workers++;
+            sel4utils_elf_loader_destroy(loader);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void
+sel4utils_elf_loader_destroy(sel4utils_elf_loader_t *loader)
+{
+    for (int i = 0; i < loader->num_workers; i++) {
+        sel4utils_elf_loader_worker_t *worker = &loader->workers[i];
+
+        if (worker->thread.tcb.cptr != 0) {
+            sel4utils_clean_up_thread(loader->vka, loader->vspace, &worker->thread);
+        }
+        if (worker->start.cptr != 0) {
+            vka_free_object(loader->vka, &worker->start);
+        }
+        for (int j = 0; j < SEL4UTILS_MAP_WINDOW_MAX_PAGES; j++) {
+            if (worker->slots[j] != 0) {
+                vka_cspace_free(loader->vka, worker->slots[j]);
+            }
+        }
+        if (worker->window_reservation.res != NULL) {
+            vspace_free_reservation(loader->vspace, worker->window_reservation);
+        }
+    }
+
+    if (loader->done.cptr != 0) {
+        vka_free_object(loader->vka, &loader->done);
+    }
+    memset(loader, 0, sizeof(*loader));
+}
+
+void *
+sel4utils_elf_load_parallel(sel4utils_elf_loader_t *loader, vspace_t *loadee, vka_t *loadee_vka,
+                            char *image_name, sel4utils_elf_region_t *regions)
+{
+    elf_info_t *info = get_elf_info(image_name);
+    if (info == NULL) {
+        LOG_ERROR("ERROR: failed to load elf file %s", image_name);
+        return NULL;
+    }
+
+    uint64_t entry_point = info->entry_point;
+    if ((uint32_t) (entry_point >> 32) != 0) {
+        LOG_ERROR("ERROR: this code hasn't been tested for 64bit!");
+        return NULL;
+    }
+    assert(entry_point != 0);
+
+    sel4utils_elf_region_t *region_space = NULL;
+    if (regions == NULL && info->num_segments > 0) {
+        region_space = calloc(info->num_segments, sizeof(sel4utils_elf_region_t));
+        if (region_space == NULL) {
+            LOG_ERROR("Failed to allocate region information");
+            return NULL;
+        }
+        regions = region_space;
+    }
+
+    /* reserve and allocate everything first, the workers only copy */
+    int error = seL4_NoError;
+    int num_regions;
+    for (num_regions = 0; num_regions < info->num_segments && !error; num_regions++) {
+        elf_segment_t *seg = &info->segments[num_regions];
+        sel4utils_elf_region_t *region = &regions[num_regions];
+        error = make_region(loadee, seg->flags, seg->segment_size, seg->vaddr, region, 0, 0);
+        if (error) {
+            LOG_ERROR("Failed to reserve region");
+            break;
+        }
+        /* small frames, which is what the worker windows map */
+        error = new_segment_frames(loadee, region->elf_vstart, region->elf_vstart + region->size,
+                                   region->reservation, 0);
+    }
+
+    if (!error) {
+        loader->loadee = loadee;
+        loader->loadee_vka = loadee_vka;
+        loader->image = info;
+        for (int i = 0; i < loader->num_workers; i++) {
+            loader->workers[i].done = 0;
+            __sync_synchronize();
+            seL4_Notify(loader->workers[i].start.cptr, 0);
+        }
+
+        /* join, notifications may be merged so check them all after every wakeup */
+        int finished;
+        do {
+            seL4_Wait(loader->done.cptr, NULL);
+            finished = 1;
+            for (int i = 0; i < loader->num_workers; i++) {
+                finished = finished && loader->workers[i].done;
+            }
+        } while (!finished);
+        __sync_synchronize();
+
+        for (int i = 0; i < loader->num_workers; i++) {
+            error = error || loader->workers[i].error;
+        }
+        if (error) {
+            LOG_ERROR("Failed to copy segments");
+        }
+    }
+
+    for (int i = 0; i < info->num_segments && !error; i++) {
+        elf_segment_t *seg = &info->segments[i];
+        if (seg->flags & PF_X) {
+            sel4utils_unify_instruction(loadee, (void *) (seL4_Word) seg->vaddr, seg->file_size);
+        }
+    }
+
+    /* give back everything allocated for a failed load. Like sel4utils_elf_load, only keep
+     * the reservations of a successful load if the regions were asked for */
+    for (int i = 0; i < num_regions && (error || region_space != NULL); i++) {
+        sel4utils_elf_region_t *region = &regions[i];
+        if (region->reservation.res == NULL) {
+            continue;
+        }
+        for (uint32_t offset = 0; offset < region->size && error; offset += PAGE_SIZE_4K) {
+            void *vaddr = region->reservation_vstart + offset;
+            if (vspace_get_cap(loadee, vaddr) != 0) {
+                vspace_unmap_pages(loadee, vaddr, 1, seL4_PageBits, VSPACE_FREE);
+            }
+        }
+        vspace_free_reservation(loadee, region->reservation);
+        region->reservation.res = NULL;
+    }
+    free(region_space);
+
+    return error == seL4_NoError ? (void*)(seL4_Word)entry_point : NULL;
+}
+
 #endif /* (defined CONFIG_LIB_SEL4_VKA && defined CONFIG_LIB_SEL4_VSPACE) */
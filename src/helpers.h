@@ -10,6 +10,28 @@
 
 #ifndef SEL4UTILS_HELPERS_H
 #define SEL4UTILS_HELPERS_H
+
+#include <sel4/sel4.h>
+#include <sel4utils/thread.h>
+
+/* Protects state that the library keeps globally, which threads on any core may use.
+ * Only held for a few list operations, so waiters yield rather than block. */
+typedef volatile int sel4utils_lock_t;
+
+static inline void
+sel4utils_lock(sel4utils_lock_t *lock)
+{
+    while (__sync_lock_test_and_set(lock, 1)) {
+        seL4_Yield();
+    }
+}
+
+static inline void
+sel4utils_unlock(sel4utils_lock_t *lock)
+{
+    __sync_lock_release(lock);
+}
+
 /**
  * Start a thread.
  *
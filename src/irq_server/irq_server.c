@@ -230,7 +230,8 @@ _irq_thread_entry(struct irq_server_thread* st)
 /* Creates a new thread for an IRQ server */
 struct irq_server_thread*
 irq_server_thread_new(vspace_t* vspace, vka_t* vka, seL4_CPtr cspace, seL4_Word priority,
-                      seL4_SchedParams_t params, seL4_CPtr sched_ctrl, seL4_CPtr irq_ctrl,
+                      seL4_SchedParams_t params, seL4_CPtr sched_ctrl, seL4_Word affinity,
+                      seL4_CPtr irq_ctrl,
                       seL4_Word label, seL4_CPtr sep) {
     struct irq_server_thread* st;
     int err;
@@ -266,7 +267,8 @@ irq_server_thread_new(vspace_t* vspace, vka_t* vka, seL4_CPtr cspace, seL4_Word
         .priority = priority,
         .max_priority = priority,
         .cspace = cspace,
-        .cspace_root_data = seL4_NilData
+        .cspace_root_data = seL4_NilData,
+        .affinity = affinity,
     };
 
     err = sel4utils_configure_thread_config(vka, vspace, vspace, config, &st->thread);
@@ -302,6 +304,7 @@ struct irq_server {
     seL4_CPtr irq_ctrl_cap;
     seL4_CPtr sc_ctrl;
     seL4_SchedParams_t params;
+    seL4_Word affinity;
     struct irq_server_thread* server_threads;
 };
 
@@ -345,7 +348,7 @@ irq_server_register_irq(irq_server_t irq_server, irq_t irq,
         st = irq_server_thread_new(irq_server->vspace, irq_server->vka, irq_server->cspace,
                                    irq_server->thread_priority,
                                    irq_server->params, irq_server->sc_ctrl,
-                                   irq_server->irq_ctrl_cap,
+                                   irq_server->affinity, irq_server->irq_ctrl_cap,
                                    irq_server->label, irq_server->delivery_ep);
         if (st == NULL) {
             LOG_ERROR("Failed to create server thread\n");
@@ -369,8 +372,8 @@ irq_server_register_irq(irq_server_t irq_server, irq_t irq,
 /* Create a new IRQ server */
 int
 irq_server_new(vspace_t* vspace, vka_t* vka, seL4_CPtr cspace, seL4_Word priority,
-               seL4_SchedParams_t params, seL4_CPtr sched_ctrl, seL4_CPtr irq_ctrl,
-               seL4_CPtr sync_ep, seL4_Word label,
+               seL4_SchedParams_t params, seL4_CPtr sched_ctrl, seL4_Word affinity,
+               seL4_CPtr irq_ctrl, seL4_CPtr sync_ep, seL4_Word label,
                int nirqs, irq_server_t *ret_irq_server)
 {
     struct irq_server* irq_server;
@@ -388,6 +391,10 @@ irq_server_new(vspace_t* vspace, vka_t* vka, seL4_CPtr cspace, seL4_Word priorit
     irq_server->cspace = cspace;
     irq_server->vka = vka;
     irq_server->thread_priority = priority;
+    irq_server->params = params;
+    irq_server->sc_ctrl = sched_ctrl;
+    irq_server->irq_ctrl_cap = irq_ctrl;
+    irq_server->affinity = affinity;
     irq_server->server_threads = NULL;
 
     /* If a fixed number of IRQs are requested, create and start the server threads */
@@ -400,7 +407,7 @@ irq_server_new(vspace_t* vspace, vka_t* vka, seL4_CPtr cspace, seL4_Word priorit
         for (i = 0; i < n_nodes; i++) {
 
             *server_thread = irq_server_thread_new(vspace, vka, cspace, priority, params,
-                                                   sched_ctrl, irq_ctrl, label, sync_ep);
+                                                   sched_ctrl, affinity, irq_ctrl, label, sync_ep);
             server_thread = &(*server_thread)->next;
         }
     }
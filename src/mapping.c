@@ -12,11 +12,14 @@
 
 #ifdef CONFIG_LIB_SEL4_VKA
 
+#include <stdlib.h>
+#include <string.h>
 #include <sel4/sel4.h>
 #include <vka/object.h>
 #include <vka/capops.h>
 #include <sel4utils/mapping.h>
 #include <sel4utils/util.h>
+#include <sel4utils/vspace.h>
 
 #ifndef DFMT
 #ifdef CONFIG_X86_64
@@ -275,6 +278,107 @@ sel4utils_map_ept_page(vka_t *vka, seL4_CPtr pd, seL4_CPtr frame, seL4_Word vadd
 
 #ifdef CONFIG_LIB_SEL4_VSPACE
 
+sel4utils_map_window_t *
+sel4utils_map_window_create(vka_t *vka, vspace_t *vspace, size_t num_pages)
+{
+    assert(num_pages > 0 && num_pages <= SEL4UTILS_MAP_WINDOW_MAX_PAGES);
+
+    sel4utils_map_window_t *window = calloc(1, sizeof(sel4utils_map_window_t));
+    if (window == NULL) {
+        LOG_ERROR("Failed to allocate mapping window");
+        return NULL;
+    }
+
+    window->vspace = vspace;
+    window->vka = vka;
+    window->reservation = vspace_reserve_range(vspace, num_pages * PAGE_SIZE_4K, seL4_AllRights,
+                                               1, &window->vaddr);
+    if (window->reservation.res == NULL) {
+        LOG_ERROR("Failed to reserve mapping window");
+        free(window);
+        return NULL;
+    }
+
+    /* with the page tables in place, mapping into the window never allocates */
+    if (sel4utils_prepare_range(vspace, window->vaddr, num_pages * PAGE_SIZE_4K) != 0) {
+        LOG_ERROR("Failed to create page tables for mapping window");
+        sel4utils_map_window_destroy(window);
+        return NULL;
+    }
+
+    for (window->num_pages = 0; window->num_pages < num_pages; window->num_pages++) {
+        if (vka_cspace_alloc(vka, &window->slots[window->num_pages]) != 0) {
+            LOG_ERROR("Failed to allocate cslot for mapping window");
+            sel4utils_map_window_destroy(window);
+            return NULL;
+        }
+        window->free |= BIT(window->num_pages);
+    }
+
+    return window;
+}
+
+void
+sel4utils_map_window_destroy(sel4utils_map_window_t *window)
+{
+    /* MASK(32) would shift by the width of the type */
+    assert(window->free == (window->num_pages == 32 ? 0xffffffff : MASK(window->num_pages)));
+
+    for (uint32_t i = 0; i < window->num_pages; i++) {
+        vka_cspace_free(window->vka, window->slots[i]);
+    }
+    vspace_free_reservation(window->vspace, window->reservation);
+    free(window);
+}
+
+void *
+sel4utils_map_window_map(sel4utils_map_window_t *window, cspacepath_t *frame)
+{
+    if (window->free == 0) {
+        return NULL;
+    }
+
+    uint32_t i = CTZ(window->free);
+    void *mapping = window->vaddr + i * PAGE_SIZE_4K;
+    cspacepath_t copy_path;
+
+    vka_cspace_make_path(window->vka, window->slots[i], &copy_path);
+    int error = vka_cnode_copy(&copy_path, frame, seL4_AllRights);
+    if (error != seL4_NoError) {
+        return NULL;
+    }
+
+    error = vspace_map_pages_at_vaddr(window->vspace, &copy_path.capPtr, NULL, mapping, 1,
+                                      seL4_PageBits, window->reservation);
+    if (error != seL4_NoError) {
+        vka_cnode_delete(&copy_path);
+        return NULL;
+    }
+
+    window->free &= ~BIT(i);
+    return mapping;
+}
+
+int
+sel4utils_map_window_unmap(sel4utils_map_window_t *window, void *mapping)
+{
+    if (mapping < window->vaddr ||
+            mapping >= window->vaddr + window->num_pages * PAGE_SIZE_4K) {
+        return -1;
+    }
+
+    uint32_t i = (mapping - window->vaddr) / PAGE_SIZE_4K;
+    cspacepath_t copy_path;
+
+    assert(!(window->free & BIT(i)));
+    vspace_unmap_pages(window->vspace, mapping, 1, seL4_PageBits, VSPACE_PRESERVE);
+    vka_cspace_make_path(window->vka, window->slots[i], &copy_path);
+    vka_cnode_delete(&copy_path);
+    window->free |= BIT(i);
+
+    return 0;
+}
+
 /* Some more generic routines for helping with mapping */
 void *
 sel4utils_dup_and_map(vka_t *vka, vspace_t *vspace, seL4_CPtr page, size_t size_bits)
@@ -319,5 +423,196 @@ sel4utils_unmap_dup(vka_t *vka, vspace_t *vspace, void *mapping, size_t size_bit
     vka_cspace_free(vka, copy);
 }
 
+/* most frames mapped together by sel4utils_vspace_copy */
+#define COPY_RUN_FRAMES 16
+
+/* largest frame size supported, in 4K pages */
+#define MAX_FRAME_PAGES BIT(sel4_supported_page_sizes[NUM_SEL4_PAGE_SIZES - 1] - seL4_PageBits)
+
+/*
+ * Find the frame mapped at vaddr in a vspace. Every 4K page of a frame reports the frame's
+ * cap, and a frame cap can only be mapped once, so the frame is the run of identical caps
+ * around vaddr.
+ *
+ * @return the frame cap, 0 if nothing is mapped
+ */
+static seL4_CPtr
+find_frame(vspace_t *vspace, void *vaddr, void **start, size_t *size_bits)
+{
+    void *page = (void *) PAGE_ALIGN_4K((seL4_Word) vaddr);
+    seL4_CPtr cap = vspace_get_cap(vspace, page);
+
+    if (cap == 0) {
+        return 0;
+    }
+
+    uint32_t before = 0;
+    while (before < MAX_FRAME_PAGES - 1 && (before + 1) * PAGE_SIZE_4K <= (seL4_Word) page &&
+            vspace_get_cap(vspace, page - (before + 1) * PAGE_SIZE_4K) == cap) {
+        before++;
+    }
+    uint32_t pages = before + 1;
+    while (pages < MAX_FRAME_PAGES && vspace_get_cap(vspace, page + (pages - before) * PAGE_SIZE_4K) == cap) {
+        pages++;
+    }
+
+    *start = page - before * PAGE_SIZE_4K;
+    *size_bits = seL4_PageBits + CTZ(pages);
+    return cap;
+}
+
+static int
+copy_vspace(vka_t *vka, vspace_t *vspace, vka_t *other_vka, vspace_t *other, void *vaddr,
+            void *local, size_t len, int to_other, sel4utils_map_window_t *window)
+{
+    seL4_CPtr caps[COPY_RUN_FRAMES];
+    seL4_CPtr copies[COPY_RUN_FRAMES];
+    void *start;
+    size_t size_bits;
+
+    while (len > 0) {
+        /* collect a run of same sized frames that are contiguous in the other vspace */
+        caps[0] = find_frame(other, vaddr, &start, &size_bits);
+        if (caps[0] == 0) {
+            LOG_ERROR("Nothing mapped at %p", vaddr);
+            return -1;
+        }
+
+        size_t offset = vaddr - start;
+        size_t run_bytes = BIT(size_bits) - offset;
+        uint32_t num_frames = 1;
+        while (num_frames < COPY_RUN_FRAMES && run_bytes < len) {
+            void *next_start;
+            size_t next_bits;
+            caps[num_frames] = find_frame(other, start + num_frames * BIT(size_bits), &next_start,
+                                          &next_bits);
+            if (caps[num_frames] == 0 || next_bits != size_bits) {
+                break;
+            }
+            run_bytes += BIT(size_bits);
+            num_frames++;
+        }
+
+        void *mapping = NULL;
+        uint32_t copied = 0;
+        int error = seL4_NoError;
+
+        /* a single small frame can go in the mapping window, if there is one */
+        if (window != NULL && num_frames == 1 && size_bits == seL4_PageBits) {
+            cspacepath_t src;
+            vka_cspace_make_path(other_vka, caps[0], &src);
+            mapping = sel4utils_map_window_map(window, &src);
+            if (mapping != NULL) {
+                copies[0] = vspace_get_cap(vspace, mapping);
+            }
+        }
+        int windowed = mapping != NULL;
+
+        /* otherwise map copies of the caps next to each other in the current vspace */
+        for (; !windowed && copied < num_frames && error == seL4_NoError; copied++) {
+            cspacepath_t src, dest;
+            error = vka_cspace_alloc_path(vka, &dest);
+            if (error == seL4_NoError) {
+                vka_cspace_make_path(other_vka, caps[copied], &src);
+                error = vka_cnode_copy(&dest, &src, seL4_AllRights);
+                if (error != seL4_NoError) {
+                    vka_cspace_free(vka, dest.capPtr);
+                }
+            }
+            copies[copied] = dest.capPtr;
+        }
+        if (error != seL4_NoError) {
+            copied--;
+        }
+
+        if (!windowed && error == seL4_NoError) {
+            mapping = vspace_map_pages(vspace, copies, NULL, seL4_AllRights, num_frames, size_bits, 1);
+        }
+
+        size_t nbytes = MIN(run_bytes, len);
+        if (mapping != NULL) {
+            if (to_other) {
+                memcpy(mapping + offset, local, nbytes);
+            } else {
+                memcpy(local, mapping + offset, nbytes);
+            }
+            if (windowed) {
+                sel4utils_map_window_unmap(window, mapping);
+            } else {
+                vspace_unmap_pages(vspace, mapping, num_frames, size_bits, VSPACE_PRESERVE);
+            }
+        } else {
+            LOG_ERROR("Failed to map frames to copy");
+            error = -1;
+        }
+
+        for (uint32_t i = 0; i < copied; i++) {
+            cspacepath_t path;
+            vka_cspace_make_path(vka, copies[i], &path);
+            vka_cnode_delete(&path);
+            vka_cspace_free(vka, copies[i]);
+        }
+
+        if (error != seL4_NoError) {
+            return -1;
+        }
+
+        vaddr += nbytes;
+        local += nbytes;
+        len -= nbytes;
+    }
+
+    return 0;
+}
+
+void
+sel4utils_unify_instruction(vspace_t *vspace, void *vaddr, size_t len)
+{
+#ifdef CONFIG_ARCH_ARM
+    void *end = vaddr + len;
+
+    while (vaddr < end) {
+        void *start;
+        size_t size_bits;
+        seL4_CPtr cap = find_frame(vspace, vaddr, &start, &size_bits);
+        void *frame_end = start + BIT(size_bits);
+        if (cap != 0) {
+            /* the kernel only cleans within one frame per call */
+            seL4_ARM_Page_Unify_Instruction(cap, vaddr - start, MIN(end, frame_end) - start);
+        }
+        vaddr = cap != 0 ? frame_end : (void *) PAGE_ALIGN_4K((seL4_Word) vaddr) + PAGE_SIZE_4K;
+    }
+#endif /* CONFIG_ARCH_ARM */
+}
+
+int
+sel4utils_vspace_copy(vka_t *vka, vspace_t *vspace, vspace_t *dst_vspace, void *dst,
+                      const void *src, size_t len)
+{
+    return copy_vspace(vka, vspace, vka, dst_vspace, dst, (void *) src, len, 1, NULL);
+}
+
+int
+sel4utils_map_window_copy(sel4utils_map_window_t *window, vspace_t *dst_vspace, void *dst,
+                          const void *src, size_t len)
+{
+    return copy_vspace(window->vka, window->vspace, window->vka, dst_vspace, dst, (void *) src,
+                       len, 1, window);
+}
+
+int
+sel4utils_vspace_copy_vka(vka_t *vka, vspace_t *vspace, vka_t *dst_vka, vspace_t *dst_vspace,
+                          void *dst, const void *src, size_t len)
+{
+    return copy_vspace(vka, vspace, dst_vka, dst_vspace, dst, (void *) src, len, 1, NULL);
+}
+
+int
+sel4utils_vspace_copy_from(vka_t *vka, vspace_t *vspace, vspace_t *src_vspace, void *dst,
+                           const void *src, size_t len)
+{
+    return copy_vspace(vka, vspace, vka, src_vspace, (void *) src, dst, len, 0, NULL);
+}
+
 #endif /* CONFIG_LIB_SEL4_VSAPCE */
 #endif /* CONFIG_LIB_SEL4_VKA */
@@ -23,6 +23,7 @@
 #include <sel4utils/util.h>
 #include <sel4utils/elf.h>
 #include <sel4utils/mapping.h>
+#include <sel4utils/stack.h>
 #include "helpers.h"
 
 static int recurse = 0;
@@ -124,61 +125,78 @@ sel4utils_copy_cap_to_process(sel4utils_process_t *process, cspacepath_t src)
     return dest.capPtr;
 }
 
+/* The top of a new stack, built in a local buffer and then copied into the target
+ * vspace in one go by sel4utils_stack_flush */
+typedef struct stack_image {
+    char *buf;
+    size_t size;
+    /* address in the target vspace of the end of buf */
+    uintptr_t end;
+} stack_image_t;
+
 static int
-sel4utils_stack_write(vspace_t *current_vspace, vspace_t *target_vspace,
-                      vka_t *vka, void *buf, size_t len, uintptr_t *stack_top)
+sel4utils_stack_init(stack_image_t *image, uintptr_t stack_top, size_t size)
 {
-    size_t remaining = len;
-    size_t written = 0;
-    uintptr_t new_stack_top = (*stack_top) - len;
-    uintptr_t current_dest = new_stack_top;
-    while (remaining > 0) {
-        /* How many can we write on the current page ? */
-        size_t towrite = MIN(ROUND_UP(current_dest, PAGE_SIZE_4K) - current_dest, remaining);
-        /* Get the cap */
-        seL4_CPtr frame = vspace_get_cap(target_vspace, (void*)PAGE_ALIGN_4K(current_dest));
-        if (!frame) {
-            return -1;
-        }
-        /* map it in */
-        void *mapping = sel4utils_dup_and_map(vka, current_vspace, frame, seL4_PageBits);
-        if (!mapping) {
-            return -1;
-        }
-        /* Copy the portion */
-        memcpy(mapping + (current_dest % PAGE_SIZE_4K), buf + written, towrite);
-        /* Unmap */
-        sel4utils_unmap_dup(vka, current_vspace, mapping, seL4_PageBits);
-        remaining -= towrite;
-        written += towrite;
-        current_dest += towrite;
+    /* zeroed so that alignment gaps don't hand our heap contents to the new process */
+    image->buf = calloc(1, size);
+    if (image->buf == NULL) {
+        LOG_ERROR("Failed to allocate memory to build stack");
+        return -1;
     }
-    *stack_top = new_stack_top;
+    image->size = size;
+    image->end = stack_top;
     return 0;
 }
 
-static int
-sel4utils_stack_write_constant(vspace_t *current_vspace, vspace_t *target_vspace,
-                               vka_t *vka, long value, uintptr_t *stack_top)
+static void
+sel4utils_stack_write(stack_image_t *image, void *buf, size_t len, uintptr_t *stack_top)
 {
-    return sel4utils_stack_write(current_vspace, target_vspace, vka, &value, sizeof(value), stack_top);
+    uintptr_t new_stack_top = (*stack_top) - len;
+
+    assert(image->end - new_stack_top <= image->size);
+    memcpy(image->buf + image->size - (image->end - new_stack_top), buf, len);
+    *stack_top = new_stack_top;
 }
 
-static int
-sel4utils_stack_copy_args(vspace_t *current_vspace, vspace_t *target_vspace,
-                          vka_t *vka, int argc, char *argv[], uintptr_t *dest_argv, uintptr_t *stack_top)
+static void
+sel4utils_stack_write_constant(stack_image_t *image, long value, uintptr_t *stack_top)
+{
+    sel4utils_stack_write(image, &value, sizeof(value), stack_top);
+}
+
+static void
+sel4utils_stack_copy_args(stack_image_t *image, int argc, char *argv[], uintptr_t *dest_argv,
+                          uintptr_t *stack_top)
 {
     int i;
-    int error;
     for (i = 0; i < argc; i++) {
-        error = sel4utils_stack_write(current_vspace, target_vspace, vka, argv[i], strlen(argv[i]) + 1, stack_top);
-        if (error) {
-            return error;
-        }
+        sel4utils_stack_write(image, argv[i], strlen(argv[i]) + 1, stack_top);
         dest_argv[i] = *stack_top;
         *stack_top = ROUND_DOWN(*stack_top, 4);
     }
-    return 0;
+}
+
+/* space needed on the stack by sel4utils_stack_copy_args */
+static size_t
+sel4utils_stack_args_size(int argc, char *argv[])
+{
+    size_t size = 0;
+    for (int i = 0; i < argc; i++) {
+        size += strlen(argv[i]) + 1 + 3;
+    }
+    return size;
+}
+
+/* copy everything written below the end of the image into the target, and free the image */
+static int
+sel4utils_stack_flush(vspace_t *current_vspace, vspace_t *target_vspace, vka_t *vka,
+                      stack_image_t *image, uintptr_t stack_top)
+{
+    size_t len = image->end - stack_top;
+    int error = sel4utils_vspace_copy(vka, current_vspace, target_vspace, (void *) stack_top,
+                                      image->buf + image->size - len, len);
+    free(image->buf);
+    return error;
 }
 
 int
@@ -187,21 +205,22 @@ sel4utils_spawn_process(sel4utils_process_t *process, vka_t *vka, vspace_t *vspa
 {
     uintptr_t stack_top = (uintptr_t)process->thread.stack_top - 4;
     uintptr_t new_process_argv = 0;
+    stack_image_t image;
     int error;
 
+    error = sel4utils_stack_init(&image, stack_top, sel4utils_stack_args_size(argc, argv) +
+                                 sizeof(uintptr_t) * argc + sizeof(int) * 2 + sizeof(uint32_t) * 6);
+    if (error) {
+        return -1;
+    }
+
     /* write all the strings into the stack */
     if (argc > 0) {
         uintptr_t dest_argv[argc];
         /* Copy over the user arguments */
-        error = sel4utils_stack_copy_args(vspace, &process->vspace, vka, argc, argv, dest_argv, &stack_top);
-        if (error) {
-            return -1;
-        }
+        sel4utils_stack_copy_args(&image, argc, argv, dest_argv, &stack_top);
         /* Put the new argv array on as well */
-        error = sel4utils_stack_write(vspace, &process->vspace, vka, dest_argv, sizeof(dest_argv), &stack_top);
-        if (error) {
-            return -1;
-        }
+        sel4utils_stack_write(&image, dest_argv, sizeof(dest_argv), &stack_top);
         new_process_argv = stack_top;
     }
     /* Some architectures want stack to be double word aligned */
@@ -211,11 +230,14 @@ sel4utils_spawn_process(sel4utils_process_t *process, vka_t *vka, vspace_t *vspa
 #ifdef CONFIG_ARCH_IA32
     /* Write 6 words to make the argument list */
     uint32_t stack_args[6] = {0, (uint32_t)argc, (uint32_t)new_process_argv, process->thread.ipc_buffer, 0, 0};
-    error = sel4utils_stack_write(vspace, &process->vspace, vka, stack_args, sizeof(stack_args), &stack_top);
+    sel4utils_stack_write(&image, stack_args, sizeof(stack_args), &stack_top);
+#endif
+
+    /* now put it all on the real stack */
+    error = sel4utils_stack_flush(vspace, &process->vspace, vka, &image, stack_top);
     if (error) {
         return -1;
     }
-#endif
 
     error = sel4utils_internal_start_thread(&process->thread, process->entry_point,
                                             (void *) argc, (void *) new_process_argv, resume, NULL, (void*)stack_top);
@@ -242,62 +264,53 @@ sel4utils_spawn_process_v(sel4utils_process_t *process, vka_t *vka, vspace_t *vs
 #endif
     seL4_UserContext context;
     memset(&context, 0, sizeof(context));
-    /* write all the strings into the stack */
+    /* build the initial stack frame locally */
     uintptr_t stack_top = (uintptr_t)process->thread.stack_top - 4;
     uintptr_t dest_argv[argc];
     uintptr_t dest_envp[envc];
+    stack_image_t image;
     int error;
-    /* Copy over the user arguments */
-    error = sel4utils_stack_copy_args(vspace, &process->vspace, vka, argc, argv, dest_argv, &stack_top);
+
+    error = sel4utils_stack_init(&image, stack_top, sel4utils_stack_args_size(argc, argv) +
+                                 sel4utils_stack_args_size(envc, envp) + sizeof(auxv) +
+                                 sizeof(dest_argv) + sizeof(dest_envp) + sizeof(long) * 5);
     if (error) {
         return -1;
     }
+
+    /* write all the strings into the stack */
+    /* Copy over the user arguments */
+    sel4utils_stack_copy_args(&image, argc, argv, dest_argv, &stack_top);
     /* copy the environment */
-    error = sel4utils_stack_copy_args(vspace, &process->vspace, vka, envc, envp, dest_envp, &stack_top);
-    if (error) {
-        return -1;
-    }
+    sel4utils_stack_copy_args(&image, envc, envp, dest_envp, &stack_top);
 
 #if defined(CONFIG_ARCH_IA32) || defined(CONFIG_ARCH_ARM) || defined(CONFIG_X86_64)
     /* construct initial stack frame */
     /* Null terminate aux */
-    error = sel4utils_stack_write_constant(vspace, &process->vspace, vka, 0, &stack_top);
-    if (error) {
-        return -1;
-    }
-    error = sel4utils_stack_write_constant(vspace, &process->vspace, vka, 0, &stack_top);
-    if (error) {
-        return -1;
-    }
+    sel4utils_stack_write_constant(&image, 0, &stack_top);
+    sel4utils_stack_write_constant(&image, 0, &stack_top);
     /* write aux */
-    error = sel4utils_stack_write(vspace, &process->vspace, vka, auxv, sizeof(auxv[0]) * auxc, &stack_top);
-    if (error) {
-        return -1;
-    }
+    sel4utils_stack_write(&image, auxv, sizeof(auxv[0]) * auxc, &stack_top);
     /* Null terminate environment */
-    error = sel4utils_stack_write_constant(vspace, &process->vspace, vka, 0, &stack_top);
-    if (error) {
-        return -1;
-    }
+    sel4utils_stack_write_constant(&image, 0, &stack_top);
     /* write environment */
-    error = sel4utils_stack_write(vspace, &process->vspace, vka, dest_envp, sizeof(dest_envp), &stack_top);
-    if (error) {
-        return -1;
-    }
+    sel4utils_stack_write(&image, dest_envp, sizeof(dest_envp), &stack_top);
     /* Null terminate arguments */
-    error = sel4utils_stack_write(vspace, &process->vspace, vka, dest_argv, sizeof(dest_argv), &stack_top);
-    if (error) {
-        return -1;
-    }
+    sel4utils_stack_write_constant(&image, 0, &stack_top);
+    /* write arguments */
+    sel4utils_stack_write(&image, dest_argv, sizeof(dest_argv), &stack_top);
     /* Push argument count */
-    error = sel4utils_stack_write_constant(vspace, &process->vspace, vka, argc, &stack_top);
-    if (error) {
-        return -1;
-    }
+    sel4utils_stack_write_constant(&image, argc, &stack_top);
 #else
 #error Not implemented yet
 #endif
 
+    /* now put the whole frame on the real stack */
+    error = sel4utils_stack_flush(vspace, &process->vspace, vka, &image, stack_top);
+    if (error) {
+        return -1;
+    }
+
 #if defined(CONFIG_ARCH_IA32)
     /* No atexit pointer */
     context.edx = 0;
@@ -443,6 +456,19 @@ int sel4utils_configure_process_custom(sel4utils_process_t *process, vka_t *vka,
     seL4_CapData_t cspace_root_data = seL4_CapData_Guard_new(0,
                                                              seL4_WordBits - config.one_level_cspace_size_bits);
 
+    /* a vspace whose faults are handled by another thread can't share our vka */
+    bool handled_faults = config.is_elf && (config.do_elf_load ?
+                                            !config.share_elf_text && (config.lazy_bss || config.lazy_elf_load) :
+                                            config.elf_image != NULL);
+    vka_t *vspace_vka = vka;
+    if (handled_faults && config.create_vspace) {
+        if (config.fault_vka == NULL || config.fault_vka == vka) {
+            LOG_ERROR("Lazily loaded processes need a fault_vka of their own");
+            goto error;
+        }
+        vspace_vka = config.fault_vka;
+    }
+
     /* create a page directory */
     if (config.create_vspace) {
         error = vka_alloc_page_directory(vka, &process->pd);
@@ -481,8 +507,8 @@ int sel4utils_configure_process_custom(sel4utils_process_t *process, vka_t *vka,
 
     /* create a vspace */
     if (config.create_vspace) {
-        sel4utils_get_vspace(spawner_vspace, &process->vspace, &process->data, vka, process->pd.cptr,
-                             sel4utils_allocated_object, (void *) process);
+        sel4utils_get_vspace(spawner_vspace, &process->vspace, &process->data, vspace_vka,
+                             process->pd.cptr, sel4utils_allocated_object, (void *) process);
 
         if (config.num_reservations > 0) {
             if (create_reservations(&process->vspace, config.num_reservations,
@@ -496,7 +522,40 @@ int sel4utils_configure_process_custom(sel4utils_process_t *process, vka_t *vka,
 
     /* finally elf load */
     if (config.is_elf) {
-        if (config.do_elf_load) {
+        if (config.do_elf_load && config.share_elf_text) {
+            process->elf_image = sel4utils_elf_image_cache_get(spawner_vspace, vka, config.image_name);
+            if (process->elf_image == NULL) {
+                goto error;
+            }
+            process->num_elf_regions = process->elf_image->num_regions;
+            process->elf_regions = calloc(process->num_elf_regions, sizeof(*process->elf_regions));
+            if (!process->elf_regions) {
+                LOG_ERROR("Failed to allocate memory for elf region information");
+                goto error;
+            }
+            process->entry_point = sel4utils_elf_load_shared(process->elf_image, &process->vspace,
+                                                             spawner_vspace, vka, vka,
+                                                             process->elf_regions);
+        } else if (config.do_elf_load && config.lazy_bss) {
+            /* keep the regions, their reservations are what the fault handler looks at */
+            process->num_elf_regions = sel4utils_elf_num_regions(config.image_name);
+            process->elf_regions = calloc(process->num_elf_regions, sizeof(*process->elf_regions));
+            if (!process->elf_regions) {
+                LOG_ERROR("Failed to allocate memory for elf region information");
+                goto error;
+            }
+            process->entry_point = sel4utils_elf_load_lazy_bss(&process->vspace, spawner_vspace, vspace_vka, vka,
+                                                               config.image_name, process->elf_regions);
+        } else if (config.do_elf_load && config.lazy_elf_load) {
+            process->num_elf_regions = sel4utils_elf_num_regions(config.image_name);
+            process->elf_regions = calloc(process->num_elf_regions, sizeof(*process->elf_regions));
+            if (!process->elf_regions) {
+                LOG_ERROR("Failed to allocate memory for elf region information");
+                goto error;
+            }
+            process->entry_point = sel4utils_elf_load_lazy(&process->vspace, spawner_vspace,
+                                                           config.image_name, process->elf_regions);
+        } else if (config.do_elf_load) {
             process->entry_point = sel4utils_elf_load(&process->vspace, spawner_vspace, vka, vka, config.image_name);
         } else {
             process->num_elf_regions = sel4utils_elf_num_regions(config.image_name);
@@ -505,7 +564,13 @@ int sel4utils_configure_process_custom(sel4utils_process_t *process, vka_t *vka,
                 LOG_ERROR("Failed to allocate memory for elf region information");
                 goto error;
             }
-            process->entry_point = sel4utils_elf_reserve(&process->vspace, config.image_name, process->elf_regions);
+            if (config.elf_image != NULL) {
+                process->elf_image = config.elf_image;
+                process->entry_point = sel4utils_elf_image_share(config.elf_image, &process->vspace,
+                                                                 vspace_vka, process->elf_regions);
+            } else {
+                process->entry_point = sel4utils_elf_reserve(&process->vspace, config.image_name, process->elf_regions);
+            }
         }
 
         if (process->entry_point == NULL) {
@@ -532,6 +597,8 @@ int sel4utils_configure_process_custom(sel4utils_process_t *process, vka_t *vka,
         .sched_control = config.sched_control,
         .cspace = process->cspace.cptr,
         .cspace_root_data = cspace_root_data,
+        .affinity = config.affinity,
+        .stack_canary = config.stack_canary,
     };
 
     error = sel4utils_configure_thread_config(vka, spawner_vspace, &process->vspace, thread_config, &process->thread);
@@ -571,6 +638,146 @@ error:
     return -1;
 }
 
+/* unmap the shared frames of a cpio file from the process and delete our copies of them */
+static void
+unshare_cpio_pages(sel4utils_process_t *process, vka_t *vka, void *vaddr, size_t num_pages)
+{
+    for (size_t i = 0; i < num_pages; i++) {
+        void *page = vaddr + i * PAGE_SIZE_4K;
+        seL4_CPtr cap = vspace_get_cap(&process->vspace, page);
+        if (cap != 0 && vspace_get_cookie(&process->vspace, page) != 0) {
+            /* a partial page that was copied into a frame of the process's own */
+            vspace_unmap_pages(&process->vspace, page, 1, seL4_PageBits, VSPACE_FREE);
+        } else if (cap != 0) {
+            cspacepath_t path;
+            vspace_unmap_pages(&process->vspace, page, 1, seL4_PageBits, VSPACE_PRESERVE);
+            vka_cspace_make_path(vka, cap, &path);
+            vka_cnode_delete(&path);
+            vka_cspace_free(vka, cap);
+        }
+    }
+}
+
+void *
+sel4utils_map_cpio_file(sel4utils_process_t *process, vka_t *vka, vspace_t *vspace,
+                        char *name, unsigned long *size)
+{
+    char *file = sel4utils_cpio_get_file(name, size);
+    if (file == NULL) {
+        LOG_ERROR("Failed to find %s in the cpio archive", name);
+        return NULL;
+    }
+
+    void *start = (void *) PAGE_ALIGN_4K((seL4_Word) file);
+    size_t num_pages = BYTES_TO_4K_PAGES(ROUND_UP((seL4_Word) file + *size, PAGE_SIZE_4K) -
+                                         (seL4_Word) start);
+
+    sel4utils_cpio_mapping_t *mapping = malloc(sizeof(*mapping));
+    if (mapping == NULL) {
+        LOG_ERROR("Failed to allocate cpio mapping");
+        return NULL;
+    }
+
+    mapping->num_pages = num_pages;
+    mapping->reservation = vspace_reserve_range(&process->vspace, num_pages * PAGE_SIZE_4K,
+                                                seL4_CanRead, 1, &mapping->vaddr);
+    if (mapping->reservation.res == NULL) {
+        LOG_ERROR("Failed to reserve range for %s", name);
+        free(mapping);
+        return NULL;
+    }
+
+    int error = 0;
+    size_t i;
+    for (i = 0; i < num_pages && !error; i++) {
+        char *page = start + i * PAGE_SIZE_4K;
+        char *from = MAX(file, page);
+        char *to = MIN(file + *size, page + PAGE_SIZE_4K);
+        if (from != page || to != page + PAGE_SIZE_4K) {
+            /* the file only covers part of this page, so copy that part into a fresh
+             * frame rather than handing the process whatever else is on the page */
+            error = vspace_new_pages_at_vaddr(&process->vspace, mapping->vaddr + i * PAGE_SIZE_4K,
+                                              1, seL4_PageBits, mapping->reservation);
+            if (error) {
+                LOG_ERROR("Failed to allocate frame for partial page of %s", name);
+                break;
+            }
+            error = sel4utils_vspace_copy(vka, vspace, &process->vspace,
+                                          mapping->vaddr + (from - (char *) start), from, to - from);
+            if (error) {
+                LOG_ERROR("Failed to copy partial page of %s", name);
+                vspace_unmap_pages(&process->vspace, mapping->vaddr + i * PAGE_SIZE_4K, 1,
+                                   seL4_PageBits, VSPACE_FREE);
+                break;
+            }
+            continue;
+        }
+
+        cspacepath_t src, dest;
+        seL4_CPtr cap = vspace_get_cap(vspace, start + i * PAGE_SIZE_4K);
+        if (cap == 0) {
+            LOG_ERROR("No cap to the archive frame at %p", start + i * PAGE_SIZE_4K);
+            error = -1;
+            break;
+        }
+
+        vka_cspace_make_path(vka, cap, &src);
+        error = vka_cspace_alloc_path(vka, &dest);
+        if (error) {
+            LOG_ERROR("Failed to allocate slot");
+            break;
+        }
+        error = vka_cnode_copy(&dest, &src, seL4_CanRead);
+        if (!error) {
+            /* no cookie, the frame is not ours to free */
+            error = vspace_map_pages_at_vaddr(&process->vspace, &dest.capPtr, NULL,
+                                              mapping->vaddr + i * PAGE_SIZE_4K, 1, seL4_PageBits,
+                                              mapping->reservation);
+            if (error) {
+                vka_cnode_delete(&dest);
+            }
+        }
+        if (error) {
+            LOG_ERROR("Failed to map archive frame into process");
+            vka_cspace_free(vka, dest.capPtr);
+        }
+    }
+
+    if (error) {
+        unshare_cpio_pages(process, vka, mapping->vaddr, i);
+        vspace_free_reservation(&process->vspace, mapping->reservation);
+        free(mapping);
+        return NULL;
+    }
+
+    mapping->next = process->cpio_mappings;
+    process->cpio_mappings = mapping;
+
+    return mapping->vaddr + (file - (char *) start);
+}
+
+void
+sel4utils_unmap_cpio_file(sel4utils_process_t *process, vka_t *vka, void *file)
+{
+    sel4utils_cpio_mapping_t **prev = &process->cpio_mappings;
+    void *vaddr = (void *) PAGE_ALIGN_4K((seL4_Word) file);
+
+    while (*prev != NULL && (*prev)->vaddr != vaddr) {
+        prev = &(*prev)->next;
+    }
+
+    if (*prev == NULL) {
+        LOG_ERROR("No cpio file mapped at %p", file);
+        return;
+    }
+
+    sel4utils_cpio_mapping_t *mapping = *prev;
+    *prev = mapping->next;
+    unshare_cpio_pages(process, vka, mapping->vaddr, mapping->num_pages);
+    vspace_free_reservation(&process->vspace, mapping->reservation);
+    free(mapping);
+}
+
 void
 sel4utils_destroy_process(sel4utils_process_t *process, vka_t *vka)
 {
@@ -589,11 +796,30 @@ sel4utils_destroy_process(sel4utils_process_t *process, vka_t *vka)
     /* destroy the cnode */
     vka_free_object(vka, &process->cspace);
 
-    /* tear down the vspace */
+    /* the vspace may have been given an allocator of its own, see fault_vka */
+    vka_t *vspace_vka = process->data.vka != NULL ? process->data.vka : vka;
+
+    /* give back any frames shared from an elf image, they are not ours to free */
+    if (process->elf_image != NULL) {
+        sel4utils_elf_image_unshare(&process->vspace, vspace_vka, process->elf_regions,
+                                    process->num_elf_regions);
+    }
+
+    /* and any files shared from the cpio archive */
+    while (process->cpio_mappings != NULL) {
+        sel4utils_unmap_cpio_file(process, vka, process->cpio_mappings->vaddr);
+    }
+
+    /* tear down the vspace, stacks kept for reuse go with everything else */
+    sel4utils_stack_pool_discard(&process->vspace);
     vspace_tear_down(&process->vspace, VSPACE_FREE);
 
+    if (process->elf_regions) {
+        free(process->elf_regions);
+    }
+
     /* free any objects created by the vspace */
-    clear_objects(process, vka);
+    clear_objects(process, vspace_vka);
 
     /* destroy the endpoint */
     if (process->fault_endpoint.cptr != 0) {
@@ -8,16 +8,161 @@
  * @TAG(NICTA_BSD)
  */
 
+#include <autoconf.h>
 #include <errno.h>
+#include <stdlib.h>
 #include <vspace/vspace.h>
+#include <sel4utils/mapping.h>
 #include <sel4utils/stack.h>
 #include <sel4utils/util.h>
 #include <utils/stack.h>
+#include "helpers.h"
+
+/* stacks are 2^n pages, for n below this */
+#define STACK_CLASSES 20
+
+typedef struct free_stack {
+    void *stack_top;
+    struct free_stack *next;
+} free_stack_t;
+
+/* stacks freed in a vspace and kept for reuse, by size. Pools are keyed by the vspace's
+ * data rather than the vspace_t, as copies of a vspace_t share the same data */
+typedef struct stack_pool {
+    void *vspace_data;
+    int num_free[STACK_CLASSES];
+    free_stack_t *free[STACK_CLASSES];
+    struct stack_pool *next;
+} stack_pool_t;
+
+/* stack_lock protects the list and the contents of every pool */
+static stack_pool_t *stack_pools;
+static sel4utils_lock_t stack_lock;
+
+static stack_pool_t *
+find_pool(vspace_t *vspace, stack_pool_t ***prev)
+{
+    stack_pool_t **pool = &stack_pools;
+    while (*pool != NULL && (*pool)->vspace_data != vspace->data) {
+        pool = &(*pool)->next;
+    }
+
+    if (prev != NULL) {
+        *prev = pool;
+    }
+    return *pool;
+}
+
+/* the smallest n such that 2^n pages hold size bytes */
+static int
+stack_class(size_t size)
+{
+    size_t pages = BYTES_TO_4K_PAGES(size);
+    int class = 0;
+    while (class < STACK_CLASSES && BIT(class) < pages) {
+        class++;
+    }
+    return class;
+}
+
+static void
+release_stack(vspace_t *vspace, void *stack_top, int class, vka_t *vka)
+{
+    void *stack_bottom = stack_top - BIT(class) * PAGE_SIZE_4K;
+    vspace_unmap_pages(vspace, stack_bottom, BIT(class), seL4_PageBits, vka);
+    /* the reservation includes the guard page */
+    vspace_free_reservation_by_vaddr(vspace, stack_bottom - PAGE_SIZE_4K);
+}
+
+size_t
+sel4utils_stack_size(size_t size)
+{
+    return BIT(stack_class(size)) * PAGE_SIZE_4K;
+}
+
+void *
+sel4utils_new_stack(vspace_t *vspace, size_t size)
+{
+    int class = stack_class(size);
+    if (class == STACK_CLASSES) {
+        LOG_ERROR("Stack of %u bytes is too big", (uint32_t) size);
+        return NULL;
+    }
+
+    free_stack_t *stack = NULL;
+    sel4utils_lock(&stack_lock);
+    stack_pool_t *pool = find_pool(vspace, NULL);
+    if (pool != NULL && pool->free[class] != NULL) {
+        stack = pool->free[class];
+        pool->free[class] = stack->next;
+        pool->num_free[class]--;
+    }
+    sel4utils_unlock(&stack_lock);
+
+    if (stack != NULL) {
+        void *stack_top = stack->stack_top;
+        free(stack);
+        return stack_top;
+    }
+
+    size_t num_pages = BIT(class);
+    void *vaddr;
+    /* one extra page for the guard, which is left reserved but unmapped */
+    reservation_t reservation = vspace_reserve_range(vspace, (num_pages + 1) * PAGE_SIZE_4K,
+                                                     seL4_AllRights, 1, &vaddr);
+    if (reservation.res == NULL) {
+        return NULL;
+    }
+
+    void *stack_bottom = vaddr + PAGE_SIZE_4K;
+    int error = vspace_new_pages_at_vaddr(vspace, stack_bottom, num_pages, seL4_PageBits, reservation);
+    if (error) {
+        vspace_free_reservation(vspace, reservation);
+        return NULL;
+    }
+
+    return stack_bottom + num_pages * PAGE_SIZE_4K;
+}
+
+void
+sel4utils_free_stack(vspace_t *vspace, void *stack_top, size_t size)
+{
+    int class = stack_class(size);
+    assert(class < STACK_CLASSES);
+
+    int kept = 0;
+    sel4utils_lock(&stack_lock);
+    stack_pool_t **prev;
+    stack_pool_t *pool = find_pool(vspace, &prev);
+    if (pool == NULL && CONFIG_SEL4UTILS_STACK_POOL_SIZE > 0) {
+        pool = calloc(1, sizeof(stack_pool_t));
+        if (pool != NULL) {
+            pool->vspace_data = vspace->data;
+            *prev = pool;
+        }
+    }
+
+    if (pool != NULL && pool->num_free[class] < CONFIG_SEL4UTILS_STACK_POOL_SIZE) {
+        free_stack_t *stack = malloc(sizeof(free_stack_t));
+        if (stack != NULL) {
+            stack->stack_top = stack_top;
+            stack->next = pool->free[class];
+            pool->free[class] = stack;
+            pool->num_free[class]++;
+            kept = 1;
+        }
+    }
+    sel4utils_unlock(&stack_lock);
+
+    if (!kept) {
+        release_stack(vspace, stack_top, class, VSPACE_FREE);
+    }
+}
 
 int
 sel4utils_run_on_stack(vspace_t *vspace, int (*func)(void))
 {
-    void *stack_top = vspace_new_stack(vspace);
+    void *stack_top = sel4utils_new_stack(vspace, CONFIG_SEL4UTILS_STACK_SIZE);
     if (stack_top == NULL) {
         LOG_ERROR("Failed to allocate new stack\n");
         return -1;
@@ -25,3 +170,44 @@ sel4utils_run_on_stack(vspace_t *vspace, int (*func)(void))
 
     return utils_run_on_stack(stack_top, func);
 }
+
+static void
+empty_pool(vspace_t *vspace, vka_t *vka, int release)
+{
+    stack_pool_t **prev;
+    sel4utils_lock(&stack_lock);
+    stack_pool_t *pool = find_pool(vspace, &prev);
+    if (pool != NULL) {
+        *prev = pool->next;
+    }
+    sel4utils_unlock(&stack_lock);
+
+    if (pool == NULL) {
+        return;
+    }
+
+    for (int class = 0; class < STACK_CLASSES; class++) {
+        while (pool->free[class] != NULL) {
+            free_stack_t *stack = pool->free[class];
+            pool->free[class] = stack->next;
+            if (release) {
+                release_stack(vspace, stack->stack_top, class, vka);
+            }
+            free(stack);
+        }
+    }
+
+    free(pool);
+}
+
+void
+sel4utils_stack_pool_flush(vspace_t *vspace, vka_t *vka)
+{
+    empty_pool(vspace, vka, 1);
+}
+
+void
+sel4utils_stack_pool_discard(vspace_t *vspace)
+{
+    empty_pool(vspace, NULL, 0);
+}
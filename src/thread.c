@@ -21,14 +21,100 @@
 #include <sel4/messages.h>
 #include <vka/vka.h>
 #include <vka/object.h>
+#include <vka/capops.h>
 #include <vspace/vspace.h>
 #include <sel4utils/mapping.h>
+#include <sel4utils/stack.h>
 #include <sel4utils/thread.h>
 #include <sel4utils/util.h>
+#include <sel4utils/vspace.h>
 #include <sel4utils/arch/util.h>
 
 #include "helpers.h"
 
+/* each thread of a batch gets a guard page, its stack and its ipc buffer */
+#define BATCH_THREAD_PAGES(stack_size) (1 + BYTES_TO_4K_PAGES(stack_size) + 1)
+
+/* get at a page of a thread's stack from parent, mapping it if the thread is elsewhere */
+static seL4_Word *
+map_stack_page(vka_t *vka, vspace_t *parent, vspace_t *alloc, void *page)
+{
+    if (parent == alloc) {
+        return page;
+    }
+
+    seL4_CPtr cap = vspace_get_cap(alloc, page);
+    if (cap == 0) {
+        return NULL;
+    }
+
+    return sel4utils_dup_and_map(vka, parent, cap, seL4_PageBits);
+}
+
+static void
+unmap_stack_page(vka_t *vka, vspace_t *parent, vspace_t *alloc, seL4_Word *mapping)
+{
+    if (parent != alloc) {
+        sel4utils_unmap_dup(vka, parent, mapping, seL4_PageBits);
+    }
+}
+
+static int
+fill_stack(vka_t *vka, vspace_t *parent, vspace_t *alloc, sel4utils_thread_t *thread)
+{
+    for (void *page = thread->stack_top - thread->stack_size; page < thread->stack_top;
+            page += PAGE_SIZE_4K) {
+        seL4_Word *words = map_stack_page(vka, parent, alloc, page);
+        if (words == NULL) {
+            LOG_ERROR("Failed to map stack page %p", page);
+            return -1;
+        }
+        for (int i = 0; i < PAGE_SIZE_4K / sizeof(seL4_Word); i++) {
+            words[i] = SEL4UTILS_STACK_CANARY;
+        }
+        unmap_stack_page(vka, parent, alloc, words);
+    }
+
+    thread->stack_canary = 1;
+    return 0;
+}
+
+int
+sel4utils_thread_stack_usage(vka_t *vka, vspace_t *parent, vspace_t *alloc,
+                             sel4utils_thread_t *thread, size_t *used)
+{
+    if (!thread->stack_canary) {
+        LOG_ERROR("Stack was not filled, configure the thread with stack_canary set");
+        return -1;
+    }
+
+    for (void *page = thread->stack_top - thread->stack_size; page < thread->stack_top;
+            page += PAGE_SIZE_4K) {
+        seL4_Word *words = map_stack_page(vka, parent, alloc, page);
+        if (words == NULL) {
+            LOG_ERROR("Failed to map stack page %p", page);
+            return -1;
+        }
+        int i;
+        for (i = 0; i < PAGE_SIZE_4K / sizeof(seL4_Word) && words[i] == SEL4UTILS_STACK_CANARY; i++);
+        unmap_stack_page(vka, parent, alloc, words);
+
+        if (i < PAGE_SIZE_4K / sizeof(seL4_Word)) {
+            *used = thread->stack_top - (page + i * sizeof(seL4_Word));
+            return 0;
+        }
+    }
+
+    *used = 0;
+    return 0;
+}
+
+static size_t
+config_stack_size(sel4utils_thread_config_t *config)
+{
+    return config->stack_size != 0 ? config->stack_size : CONFIG_SEL4UTILS_STACK_SIZE;
+}
+
 static int
 write_ipc_buffer_user_data(vka_t *vka, vspace_t *vspace, seL4_CPtr ipc_buf, uintptr_t buf_loc)
 {
@@ -42,6 +128,91 @@ write_ipc_buffer_user_data(vka_t *vka, vspace_t *vspace, seL4_CPtr ipc_buf, uint
     return 0;
 }
 
+#if CONFIG_MAX_NUM_NODES > 1
+/* threads configured on each core, for SEL4UTILS_AFFINITY_LEAST_LOADED. Threads waiting
+ * in a thread pool are idle and not counted. Threads may be configured from any core, so
+ * these are only changed atomically */
+static uint32_t core_threads[CONFIG_MAX_NUM_NODES];
+/* next core for SEL4UTILS_AFFINITY_ROUND_ROBIN */
+static seL4_Word next_core;
+
+static void
+count_thread(sel4utils_thread_t *thread)
+{
+    __sync_fetch_and_add(&core_threads[thread->affinity], 1);
+    thread->placed = 1;
+}
+
+static void
+uncount_thread(sel4utils_thread_t *thread)
+{
+    if (thread->placed) {
+        __sync_fetch_and_sub(&core_threads[thread->affinity], 1);
+        thread->placed = 0;
+    }
+}
+
+static seL4_Word
+place_thread(seL4_Word affinity)
+{
+    if (affinity == SEL4UTILS_AFFINITY_ROUND_ROBIN) {
+        affinity = __sync_fetch_and_add(&next_core, 1) % CONFIG_MAX_NUM_NODES;
+    } else if (affinity == SEL4UTILS_AFFINITY_LEAST_LOADED) {
+        /* threads placed at the same time may pick the same core, which only makes the
+         * spread a little less even */
+        affinity = 0;
+        for (seL4_Word core = 1; core < CONFIG_MAX_NUM_NODES; core++) {
+            if (core_threads[core] < core_threads[affinity]) {
+                affinity = core;
+            }
+        }
+    }
+
+    return affinity;
+}
+
+static int
+set_affinity(sel4utils_thread_t *res, seL4_Word affinity)
+{
+    seL4_Word core = place_thread(affinity);
+    if (core >= CONFIG_MAX_NUM_NODES) {
+        LOG_ERROR("Invalid core %d for thread", (int) core);
+        return -1;
+    }
+
+    int error = seL4_TCB_SetAffinity(res->tcb.cptr, core);
+    if (error != seL4_NoError) {
+        return error;
+    }
+
+    uncount_thread(res);
+    res->affinity = core;
+    count_thread(res);
+
+    return seL4_NoError;
+}
+#endif /* CONFIG_MAX_NUM_NODES > 1 */
+
+static int
+configure_tcb(sel4utils_thread_t *res, vspace_t *alloc, sel4utils_thread_config_t *config,
+              seL4_CPtr sched_context)
+{
+    seL4_CapData_t null_cap_data = {{0}};
+    int error = seL4_TCB_Configure(res->tcb.cptr, config->fault_endpoint, config->criticality, config->max_criticality,
+                                   config->priority, config->max_priority,
+                                   sched_context, config->cspace, config->cspace_root_data,
+                                   vspace_get_root(alloc), null_cap_data,
+                                   res->ipc_buffer_addr, res->ipc_buffer, config->temporal_fault_endpoint);
+
+#if CONFIG_MAX_NUM_NODES > 1
+    if (error == seL4_NoError) {
+        error = set_affinity(res, config->affinity);
+    }
+#endif /* CONFIG_MAX_NUM_NODES > 1 */
+
+    return error;
+}
+
 int sel4utils_configure_passive_thread(vka_t *vka, vspace_t *parent, vspace_t *alloc, seL4_CPtr fault_endpoint,
                                        uint8_t priority, seL4_CNode cspace, seL4_CapData_t cspace_root_data, sel4utils_thread_t *res)
 {
@@ -126,20 +297,15 @@ sel4utils_configure_thread_config(vka_t *vka, vspace_t *parent, vspace_t *alloc,
         }
     }
 
-    seL4_CapData_t null_cap_data = {{0}};
-    error = seL4_TCB_Configure(res->tcb.cptr, config.fault_endpoint, config.criticality, config.max_criticality, 
-                               config.priority, config.max_priority,
-                               sched_context, config.cspace, config.cspace_root_data,
-                               vspace_get_root(alloc), null_cap_data,
-                               res->ipc_buffer_addr, res->ipc_buffer, config.temporal_fault_endpoint);
-
+    error = configure_tcb(res, alloc, &config, sched_context);
     if (error != seL4_NoError) {
         LOG_ERROR("TCB configure failed with seL4 error code %d", error);
         sel4utils_clean_up_thread(vka, alloc, res);
         return -1;
     }
 
-    res->stack_top = vspace_new_stack(alloc);
+    res->stack_size = sel4utils_stack_size(config_stack_size(&config));
+    res->stack_top = sel4utils_new_stack(alloc, res->stack_size);
 
     if (res->stack_top == NULL) {
         LOG_ERROR("Stack allocation failed!");
@@ -147,9 +313,173 @@ sel4utils_configure_thread_config(vka_t *vka, vspace_t *parent, vspace_t *alloc,
         return -1;
     }
 
+    if (config.stack_canary && fill_stack(vka, parent, alloc, res)) {
+        sel4utils_clean_up_thread(vka, alloc, res);
+        return -1;
+    }
+
     return 0;
 }
 
+/* write the userData word of every ipc buffer in one mapping */
+static int
+write_ipc_buffers_user_data(vka_t *vka, vspace_t *parent, vspace_t *alloc, int num_threads,
+                            sel4utils_thread_t threads[])
+{
+    if (parent == alloc) {
+        for (int i = 0; i < num_threads; i++) {
+            ((seL4_IPCBuffer *) threads[i].ipc_buffer_addr)->userData = threads[i].ipc_buffer_addr;
+        }
+        return 0;
+    }
+
+    seL4_CPtr copies[num_threads];
+    int error = 0;
+    int i;
+    for (i = 0; i < num_threads && !error; i++) {
+        cspacepath_t src, dest;
+        error = vka_cspace_alloc_path(vka, &dest);
+        if (error) {
+            break;
+        }
+        vka_cspace_make_path(vka, threads[i].ipc_buffer, &src);
+        error = vka_cnode_copy(&dest, &src, seL4_AllRights);
+        if (error) {
+            vka_cspace_free(vka, dest.capPtr);
+            break;
+        }
+        copies[i] = dest.capPtr;
+    }
+
+    seL4_IPCBuffer *buffers = NULL;
+    if (!error) {
+        buffers = vspace_map_pages(parent, copies, NULL, seL4_AllRights, num_threads, seL4_PageBits, 1);
+        error = buffers == NULL;
+    }
+    if (!error) {
+        for (int j = 0; j < num_threads; j++) {
+            /* each buffer is a page on its own */
+            ((seL4_IPCBuffer *) ((void *) buffers + j * PAGE_SIZE_4K))->userData = threads[j].ipc_buffer_addr;
+        }
+        vspace_unmap_pages(parent, buffers, num_threads, seL4_PageBits, VSPACE_PRESERVE);
+    }
+
+    for (i--; i >= 0; i--) {
+        cspacepath_t path;
+        vka_cspace_make_path(vka, copies[i], &path);
+        vka_cnode_delete(&path);
+        vka_cspace_free(vka, copies[i]);
+    }
+
+    return error;
+}
+
+int
+sel4utils_configure_threads(vka_t *vka, vspace_t *parent, vspace_t *alloc,
+                            sel4utils_thread_config_t config, int num_threads,
+                            sel4utils_thread_t threads[], reservation_t *reservation)
+{
+    void *region;
+
+    /* batched stacks are not pooled, so only need rounding to pages */
+    size_t stack_size = ROUND_UP(config_stack_size(&config), PAGE_SIZE_4K);
+    size_t thread_pages = BATCH_THREAD_PAGES(stack_size);
+
+    memset(threads, 0, num_threads * sizeof(sel4utils_thread_t));
+
+    *reservation = vspace_reserve_range(alloc, num_threads * thread_pages * PAGE_SIZE_4K,
+                                        seL4_AllRights, 1, &region);
+    if (reservation->res == NULL) {
+        LOG_ERROR("Failed to reserve region for %d threads", num_threads);
+        return -1;
+    }
+
+    int error = 0;
+    for (int i = 0; i < num_threads && !error; i++) {
+        sel4utils_thread_t *res = &threads[i];
+        /* skip the guard page, the ipc buffer goes above the stack */
+        void *stack_bottom = region + (i * thread_pages + 1) * PAGE_SIZE_4K;
+
+        res->batched = 1;
+        error = vspace_new_pages_at_vaddr(alloc, stack_bottom, thread_pages - 1, seL4_PageBits, *reservation);
+        if (error) {
+            LOG_ERROR("Failed to allocate stack and ipc buffer of thread %d", i);
+            break;
+        }
+        res->stack_size = stack_size;
+        res->stack_top = stack_bottom + stack_size;
+        res->ipc_buffer_addr = (seL4_Word) res->stack_top;
+        res->ipc_buffer = vspace_get_cap(alloc, res->stack_top);
+
+        error = vka_alloc_tcb(vka, &res->tcb);
+        if (error) {
+            LOG_ERROR("vka_alloc tcb failed");
+            break;
+        }
+
+        if (config.create_sc) {
+            error = vka_alloc_sched_context(vka, &res->sched_context);
+            if (error) {
+                LOG_ERROR("failed to allocate sched context");
+                break;
+            }
+            res->own_sc = 1;
+            error = seL4_SchedControl_Configure(config.sched_control, res->sched_context.cptr,
+                                                config.sched_params.period, config.sched_params.deadline,
+                                                config.sched_params.budget, config.sched_params.flags);
+            if (error) {
+                LOG_ERROR("failed to populate sched context");
+                break;
+            }
+        }
+    }
+
+    for (int i = 0; i < num_threads && !error && config.stack_canary; i++) {
+        error = fill_stack(vka, parent, alloc, &threads[i]);
+    }
+
+    if (!error) {
+        error = write_ipc_buffers_user_data(vka, parent, alloc, num_threads, threads);
+        if (error) {
+            LOG_ERROR("failed to set user data word in IPC buffers");
+        }
+    }
+
+    for (int i = 0; i < num_threads && !error; i++) {
+        sel4utils_thread_t *res = &threads[i];
+        error = configure_tcb(res, alloc, &config, res->own_sc ? res->sched_context.cptr : config.sched_context);
+        if (error != seL4_NoError) {
+            LOG_ERROR("TCB configure failed with seL4 error code %d", error);
+        }
+    }
+
+    if (error) {
+        for (int i = 0; i < num_threads; i++) {
+            if (threads[i].batched) {
+                sel4utils_clean_up_thread(vka, alloc, &threads[i]);
+            }
+        }
+        vspace_free_reservation(alloc, *reservation);
+        reservation->res = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+void
+sel4utils_clean_up_threads(vka_t *vka, vspace_t *alloc, reservation_t reservation,
+                           int num_threads, sel4utils_thread_t threads[])
+{
+    for (int i = 0; i < num_threads; i++) {
+        if (threads[i].batched) {
+            sel4utils_clean_up_thread(vka, alloc, &threads[i]);
+        }
+    }
+
+    vspace_free_reservation(alloc, reservation);
+}
+
 int
 sel4utils_internal_start_thread(sel4utils_thread_t *thread, void *entry_point, void *arg0,
                                 void *arg1, int resume, void *local_stack_top, void *dest_stack_top)
@@ -227,16 +557,29 @@ sel4utils_start_thread(sel4utils_thread_t *thread, void *entry_point, void *arg0
 void
 sel4utils_clean_up_thread(vka_t *vka, vspace_t *alloc, sel4utils_thread_t *thread)
 {
+#if CONFIG_MAX_NUM_NODES > 1
+    uncount_thread(thread);
+#endif /* CONFIG_MAX_NUM_NODES > 1 */
+
     if (thread->tcb.cptr != 0) {
         vka_free_object(vka, &thread->tcb);
     }
 
-    if (thread->ipc_buffer_addr != 0) {
-        vspace_free_ipc_buffer(alloc, (seL4_Word *) thread->ipc_buffer_addr);
-    }
+    if (thread->batched) {
+        /* the stack and ipc buffer were allocated in one go, the reservation is left for
+         * sel4utils_clean_up_threads */
+        if (thread->stack_top != 0) {
+            vspace_unmap_pages(alloc, thread->stack_top - thread->stack_size,
+                               BYTES_TO_4K_PAGES(thread->stack_size) + 1, seL4_PageBits, VSPACE_FREE);
+        }
+    } else {
+        if (thread->ipc_buffer_addr != 0) {
+            vspace_free_ipc_buffer(alloc, (seL4_Word *) thread->ipc_buffer_addr);
+        }
 
-    if (thread->stack_top != 0) {
-        vspace_free_stack(alloc, thread->stack_top);
+        if (thread->stack_top != 0) {
+            sel4utils_free_stack(alloc, thread->stack_top, thread->stack_size);
+        }
     }
 
     if (thread->own_sc) {
@@ -246,6 +589,116 @@ sel4utils_clean_up_thread(vka_t *vka, vspace_t *alloc, sel4utils_thread_t *threa
     memset(thread, 0, sizeof(sel4utils_thread_t));
 }
 
+int
+sel4utils_thread_pool_init(sel4utils_thread_pool_t *pool, vka_t *vka, vspace_t *parent,
+                           vspace_t *alloc, sel4utils_thread_config_t config, int size)
+{
+    pool->vka = vka;
+    pool->parent = parent;
+    pool->alloc = alloc;
+    pool->config = config;
+    pool->reconfigured = 0;
+    pool->num_free = 0;
+    pool->max_free = size;
+    pool->free = calloc(size, sizeof(sel4utils_thread_t));
+    if (size > 0 && pool->free == NULL) {
+        LOG_ERROR("Failed to allocate thread pool");
+        return -1;
+    }
+
+    for (int i = 0; i < size; i++) {
+        if (sel4utils_configure_thread_config(vka, parent, alloc, config, &pool->free[i])) {
+            LOG_ERROR("Failed to configure thread %d of pool", i);
+            sel4utils_thread_pool_destroy(pool);
+            return -1;
+        }
+#if CONFIG_MAX_NUM_NODES > 1
+        uncount_thread(&pool->free[i]);
+#endif /* CONFIG_MAX_NUM_NODES > 1 */
+        pool->num_free++;
+    }
+
+    return 0;
+}
+
+int
+sel4utils_thread_pool_acquire(sel4utils_thread_pool_t *pool, sel4utils_thread_config_t *config,
+                              sel4utils_thread_t *res)
+{
+    if (pool->num_free == 0) {
+        return sel4utils_configure_thread_config(pool->vka, pool->parent, pool->alloc,
+                                                 config != NULL ? *config : pool->config, res);
+    }
+
+    *res = pool->free[--pool->num_free];
+    if (config == NULL && !pool->reconfigured) {
+#if CONFIG_MAX_NUM_NODES > 1
+        /* back on the core it was last placed on */
+        count_thread(res);
+#endif /* CONFIG_MAX_NUM_NODES > 1 */
+        return 0;
+    } else if (config == NULL) {
+        config = &pool->config;
+    } else {
+        pool->reconfigured = 1;
+    }
+
+    assert(config->create_sc == pool->config.create_sc);
+    assert(config_stack_size(config) <= res->stack_size);
+    int error = seL4_NoError;
+    seL4_CPtr sched_context = config->sched_context;
+    if (res->own_sc) {
+        sched_context = res->sched_context.cptr;
+        error = seL4_SchedControl_Configure(config->sched_control, sched_context,
+                                            config->sched_params.period, config->sched_params.deadline,
+                                            config->sched_params.budget, config->sched_params.flags);
+    }
+    if (error == seL4_NoError) {
+        error = configure_tcb(res, pool->alloc, config, sched_context);
+    }
+    if (error != seL4_NoError) {
+        LOG_ERROR("Failed to reconfigure thread, seL4 error code %d", error);
+        sel4utils_clean_up_thread(pool->vka, pool->alloc, res);
+        return -1;
+    }
+
+    return 0;
+}
+
+void
+sel4utils_thread_pool_release(sel4utils_thread_pool_t *pool, sel4utils_thread_t *thread)
+{
+    if (pool->num_free == pool->max_free) {
+        sel4utils_clean_up_thread(pool->vka, pool->alloc, thread);
+        return;
+    }
+
+    int error = seL4_TCB_Suspend(thread->tcb.cptr);
+    if (error != seL4_NoError) {
+        LOG_ERROR("Failed to suspend thread, seL4 error code %d", error);
+        sel4utils_clean_up_thread(pool->vka, pool->alloc, thread);
+        return;
+    }
+
+#if CONFIG_MAX_NUM_NODES > 1
+    uncount_thread(thread);
+#endif /* CONFIG_MAX_NUM_NODES > 1 */
+    pool->free[pool->num_free++] = *thread;
+    memset(thread, 0, sizeof(sel4utils_thread_t));
+}
+
+void
+sel4utils_thread_pool_destroy(sel4utils_thread_pool_t *pool)
+{
+    while (pool->num_free > 0) {
+        sel4utils_clean_up_thread(pool->vka, pool->alloc, &pool->free[--pool->num_free]);
+    }
+
+    free(pool->free);
+    pool->free = NULL;
+    pool->max_free = 0;
+}
+
 void
 sel4utils_print_fault_message(seL4_MessageInfo_t tag, char *thread_name)
 {
@@ -341,6 +794,117 @@ sel4utils_start_fault_handler(seL4_CPtr fault_endpoint, vka_t *vka, vspace_t *vs
                                   (void *) fault_endpoint, 1);
 }
 
+typedef struct lazy_fault_handler_args {
+    char *name;
+    seL4_CPtr endpoint;
+    vspace_t *target;
+    /* private to the handler, for filling lazy pages and copying pages on write */
+    sel4utils_fill_window_t window;
+} lazy_fault_handler_args_t;
+
+static int
+handle_fault(lazy_fault_handler_args_t *args, seL4_MessageInfo_t info)
+{
+    if (seL4_MessageInfo_get_label(info) != SEL4_PFIPC_LABEL) {
+        return -1;
+    }
+
+    void *vaddr = (void *) seL4_GetMR(SEL4_PFIPC_FAULT_ADDR);
+    if (sel4utils_handle_lazy_fault(args->target, &args->window, vaddr) == 0) {
+        return 0;
+    }
+
+    if (!sel4utils_is_read_fault()) {
+        return sel4utils_handle_cow_fault(args->target, &args->window, vaddr);
+    }
+
+    return -1;
+}
+
+static int
+lazy_fault_handler(lazy_fault_handler_args_t *args)
+{
+    seL4_Word badge;
+    seL4_MessageInfo_t info = seL4_Wait(args->endpoint, &badge);
+
+    while (1) {
+        if (handle_fault(args, info) == 0) {
+            /* an empty reply restarts the faulting thread */
+            info = seL4_ReplyWait(args->endpoint, seL4_MessageInfo_new(0, 0, 0, 0), &badge);
+        } else {
+            /* a real fault, report it and leave the thread blocked */
+            sel4utils_print_fault_message(info, args->name);
+            info = seL4_Wait(args->endpoint, &badge);
+        }
+    }
+
+    return 0;
+}
+
+int
+sel4utils_start_lazy_fault_handler(seL4_CPtr fault_endpoint, vka_t *vka, vspace_t *vspace,
+                                   vspace_t *target, uint8_t prio, seL4_CPtr cspace,
+                                   seL4_CapData_t cap_data, char *name, seL4_CPtr sched_control,
+                                   sel4utils_thread_t *res)
+{
+    sel4utils_thread_config_t config = {
+        .fault_endpoint = seL4_CapNull,
+        .temporal_fault_endpoint = seL4_CapNull,
+        .priority = prio,
+        .max_priority = prio,
+        .cspace = cspace,
+        .cspace_root_data = cap_data,
+        .create_sc = TRUE,
+        .sched_control = sched_control,
+        .sched_params = {
+            .period = SEL4UTILS_TIMESLICE,
+            .deadline = SEL4UTILS_TIMESLICE,
+            .budget = SEL4UTILS_TIMESLICE,
+            .flags = seL4_SchedFlags_new(seL4_TimeTriggered, seL4_HardCBS, 0),
+        }
+    };
+
+    /* the handler allocates from the target's vka while the caller keeps using its own */
+    if (((sel4utils_alloc_data_t *) target->data)->vka == vka) {
+        LOG_ERROR("Lazy fault handler target must have a vka of its own");
+        return -1;
+    }
+
+    /* lives as long as the handler does */
+    lazy_fault_handler_args_t *args = malloc(sizeof(lazy_fault_handler_args_t));
+    if (args == NULL) {
+        LOG_ERROR("Failed to allocate fault handler arguments");
+        return -1;
+    }
+
+    args->name = name;
+    args->endpoint = fault_endpoint;
+    args->target = target;
+
+    int error = sel4utils_fill_window_create(&args->window, vka, vspace);
+    if (error) {
+        free(args);
+        return -1;
+    }
+
+    error = sel4utils_configure_thread_config(vka, vspace, vspace, config, res);
+    if (error) {
+        LOG_ERROR("Failed to configure lazy fault handling thread");
+        sel4utils_fill_window_destroy(&args->window);
+        free(args);
+        return -1;
+    }
+
+    error = sel4utils_start_thread(res, lazy_fault_handler, (void *) args, NULL, 1);
+    if (error) {
+        sel4utils_clean_up_thread(vka, vspace, res);
+        sel4utils_fill_window_destroy(&args->window);
+        free(args);
+    }
+
+    return error;
+}
+
 int
 sel4utils_checkpoint_thread(sel4utils_thread_t *thread, sel4utils_checkpoint_t *checkpoint) 
 {
@@ -358,7 +922,7 @@ sel4utils_checkpoint_thread(sel4utils_thread_t *thread, sel4utils_checkpoint_t *
     }
     
     stack_size = thread->stack_top - (void *) sel4utils_get_sp(checkpoint->regs);
-    assert(stack_size <= CONFIG_SEL4UTILS_STACK_SIZE);
+    assert(stack_size <= thread->stack_size);
     
     checkpoint->stack = (uint32_t *) malloc(stack_size);
     if (checkpoint->stack == NULL) {
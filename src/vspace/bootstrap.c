@@ -79,6 +79,11 @@ common_init(vspace_t *vspace, vka_t *vka, seL4_CPtr page_directory,
     sel4utils_alloc_data_t *data = get_alloc_data(vspace);
     data->vka = vka;
     data->last_allocated = (void *) 0x10000000;
+    data->reservation_root = NULL;
+    free_index_init(&data->free_index);
+    for (int i = 0; i < SEL4UTILS_FRAME_BATCH_BUCKETS; i++) {
+        data->frame_batches[i] = NULL;
+    }
 
     data->page_directory = page_directory;
     vspace->allocated_object = allocated_object_fn;
@@ -184,6 +189,36 @@ reserve_initial_task_regions(vspace_t *vspace, void *existing_frames[])
     return 0;
 }
 
+/*
+ * Record the frames the kernel loaded the initial task into, so that they can be found with
+ * vspace_get_cap and shared, eg. by sel4utils_map_cpio_file. They have no cookie as they
+ * were never allocated by us.
+ */
+static int
+record_initial_task_frames(vspace_t *vspace, seL4_BootInfo *info)
+{
+    seL4_Word va_start, va_end;
+
+    sel4utils_get_image_region(&va_start, &va_end);
+    va_start = ROUND_DOWN(va_start, PAGE_SIZE_4K);
+
+    seL4_Word num_frames = info->userImageFrames.end - info->userImageFrames.start;
+    if (num_frames != BYTES_TO_4K_PAGES(va_end - va_start)) {
+        /* the image is not laid out as we expect, so leave it reserved but unknown */
+        LOG_INFO("Image frames do not match image region, not recording them");
+        return 0;
+    }
+
+    for (seL4_Word i = 0; i < num_frames; i++) {
+        if (update(vspace, (void *) (va_start + i * PAGE_SIZE_4K), info->userImageFrames.start + i, 0)) {
+            LOG_ERROR("Failed to record image frame %d", (int) i);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
 static int
 alloc_and_map_bootstrap_frame(vspace_t *vspace, vka_object_t *frame, void *vaddr)
 {
@@ -388,70 +423,42 @@ sel4utils_bootstrap_vspace_with_bootinfo(vspace_t *vspace, sel4utils_alloc_data_
         NULL
     };
 
-    return sel4utils_bootstrap_vspace(vspace, data, page_directory, vka, allocated_object_fn,
-                                      allocated_object_cookie, existing_frames);
+    if (sel4utils_bootstrap_vspace(vspace, data, page_directory, vka, allocated_object_fn,
+                                   allocated_object_cookie, existing_frames)) {
+        return -1;
+    }
+
+    return record_initial_task_frames(vspace, info);
 }
 
 int
 sel4utils_bootstrap_clone_into_vspace(vspace_t *current, vspace_t *clone, reservation_t image)
 {
     sel4utils_res_t *res = reservation_to_res(image);
-    seL4_CPtr slot;
-    int error = vka_cspace_alloc(get_alloc_data(current)->vka, &slot);
+    size_t bytes = res->end - res->start;
 
+    /* create the pages in the clone vspace */
+    int error = vspace_new_pages_at_vaddr(clone, res->start, BYTES_TO_4K_PAGES(bytes),
+                                          seL4_PageBits, image);
     if (error) {
+        LOG_ERROR("Error %d while trying to map pages at %p\n", error, res->start);
         return -1;
     }
 
-    cspacepath_t dest;
-    vka_cspace_make_path(get_alloc_data(current)->vka, slot, &dest);
-
-    for (void *page = res->start; page < res->end - 1; page += PAGE_SIZE_4K) {
-        /* we don't know if the current vspace has caps to its mappings -
-         * it probably doesn't.
-         *
-         * So we map the page in and copy the data across instead :( */
-
-        /* create the page in the clone vspace */
-        int error = vspace_new_pages_at_vaddr(clone, page, 1, seL4_PageBits, image);
-        if (error) {
-            /* vspace will be left inconsistent */
-            LOG_ERROR("Error %d while trying to map page at %p\n", error, page);
-        }
-
-        seL4_CPtr cap = vspace_get_cap(clone, page);
-        /* copy the cap */
-        cspacepath_t src;
-
-
-        vka_cspace_make_path(get_alloc_data(clone)->vka, cap, &src);
-        error = vka_cnode_copy(&dest, &src, seL4_AllRights);
-        assert(error == 0);
-
-        /* map a copy of it the current vspace */
-        void *dest_addr = vspace_map_pages(current, &dest.capPtr, NULL, seL4_AllRights,
-                                           1, seL4_PageBits, 1);
-        if (dest_addr == NULL) {
-            /* vspace will be left inconsistent */
-            LOG_ERROR("Error! Vspace mapping failed, bailing\n");
-            return -1;
-        }
-
-        /* copy the data */
-        memcpy(dest_addr, page, PAGE_SIZE_4K);
-
-#ifdef CONFIG_ARCH_ARM
-        seL4_ARM_Page_Unify_Instruction(dest.capPtr, 0, PAGE_SIZE_4K);
-        seL4_ARM_Page_Unify_Instruction(cap, 0, PAGE_SIZE_4K);
-#endif /* CONFIG_ARCH_ARM */
-
-        /* unmap our copy */
-        vspace_unmap_pages(current, dest_addr, 1, seL4_PageBits, VSPACE_PRESERVE);
-        vka_cnode_delete(&dest);
+    /* we don't know if the current vspace has caps to its mappings -
+     * it probably doesn't.
+     *
+     * So we map the pages in and copy the data across instead :( */
+    error = sel4utils_vspace_copy(get_alloc_data(clone)->vka, current, clone, res->start,
+                                  res->start, bytes);
+    if (error) {
+        /* vspace will be left inconsistent */
+        LOG_ERROR("Error! Vspace copy failed, bailing\n");
+        return -1;
     }
+    sel4utils_unify_instruction(clone, res->start, bytes);
 
     /* TODO swap out fault handler temporarily to ignore faults here */
-    vka_cspace_free(get_alloc_data(current)->vka, slot);
     return 0;
 }
 
@@ -26,6 +26,8 @@
 /* see comment in vspace_internal for why these checks exist */
 compile_time_assert(pages_are_4k1, BOTTOM_LEVEL_BITS_OFFSET == seL4_PageBits);
 compile_time_assert(pages_are_4k2, BIT(BOTTOM_LEVEL_BITS_OFFSET) == PAGE_SIZE_4K);
+/* the free index summary words must be able to describe every index word */
+compile_time_assert(free_index_summary_fits, VSPACE_INDEX_WORDS <= VSPACE_INDEX_WORD_BITS);
 
 static int
 create_level(vspace_t *vspace, void* vaddr)
@@ -69,6 +71,67 @@ assure_level(vspace_t *vspace, void *vaddr)
     return 0;
 }
 
+/* Record a frame that covers whole bottom levels, starting at vaddr. The range must
+ * already be known to be either empty or reserved. */
+int
+large_level_map(vspace_t *vspace, void *vaddr, seL4_CPtr cap, size_t size_bits, uint32_t cookie)
+{
+    sel4utils_alloc_data_t *data = get_alloc_data(vspace);
+    uintptr_t i;
+
+    /* The records come from malloc, which a self-bootstrapped vspace may well be
+     * backing, so leave those with plain 4K entries */
+    if (data->bootstrap == NULL || cap == RESERVED) {
+        return -1;
+    }
+
+    assert(IS_ALIGNED((uintptr_t) vaddr, size_bits));
+
+    for (i = 0; i < BIT(size_bits); i += BYTES_PER_LEVEL) {
+        uint32_t level = TOP_LEVEL_INDEX(vaddr + i);
+        assert(data->top_level[level] != (void *) RESERVED);
+        assert(!is_large_level(data->top_level[level]));
+
+        large_level_t *large = (large_level_t *) malloc(sizeof(large_level_t));
+        if (large == NULL) {
+            break;
+        }
+
+        large->cap = cap;
+        large->cookie = cookie;
+        large->size_bits = size_bits;
+        large->saved = data->top_level[level];
+        large->saved_used = data->free_index.used[level];
+
+        free_index_set_used(&data->free_index, level, VSPACE_LEVEL_SIZE);
+        data->top_level[level] = (bottom_level_t *) ((uintptr_t) large | LARGE_LEVEL_TAG);
+    }
+
+    if (i < BIT(size_bits)) {
+        /* out of memory, put back what we did and let the caller use 4K entries */
+        for (uintptr_t j = 0; j < i; j += BYTES_PER_LEVEL) {
+            large_level_release(vspace, vaddr + j);
+        }
+        return -1;
+    }
+
+    return seL4_NoError;
+}
+
+/* put back the bottom level that was set aside when the level containing vaddr was
+ * covered by a large frame */
+void
+large_level_release(vspace_t *vspace, void *vaddr)
+{
+    sel4utils_alloc_data_t *data = get_alloc_data(vspace);
+    uint32_t level = TOP_LEVEL_INDEX(vaddr);
+    large_level_t *large = to_large_level(data->top_level[level]);
+
+    data->top_level[level] = large->saved;
+    free_index_set_used(&data->free_index, level, large->saved_used);
+    free(large);
+}
+
 static int
 check_empty_range(bottom_level_t *top_level[], void *vaddr, size_t num_pages, size_t size_bits)
 {
@@ -114,68 +177,159 @@ check_reservation(bottom_level_t *top_level[], sel4utils_res_t *reservation, voi
            check_reserved_range(top_level, vaddr, num_pages, size_bits);
 }
 
+static inline int
+res_height(sel4utils_res_t *node)
+{
+    return node == NULL ? 0 : node->height;
+}
+
+/* recalculate the height and max_end of a node from its children */
 static void
-insert_reservation(sel4utils_alloc_data_t *data, sel4utils_res_t *reservation)
+res_update(sel4utils_res_t *node)
 {
+    node->height = MAX(res_height(node->left), res_height(node->right)) + 1;
+    node->max_end = node->end;
+    if (node->left != NULL && node->left->max_end > node->max_end) {
+        node->max_end = node->left->max_end;
+    }
+    if (node->right != NULL && node->right->max_end > node->max_end) {
+        node->max_end = node->right->max_end;
+    }
+}
 
-    assert(data != NULL);
-    assert(reservation != NULL);
+static sel4utils_res_t *
+res_rotate_right(sel4utils_res_t *node)
+{
+    sel4utils_res_t *left = node->left;
+    node->left = left->right;
+    left->right = node;
+    res_update(node);
+    res_update(left);
+    return left;
+}
 
-    reservation->next = NULL;
+static sel4utils_res_t *
+res_rotate_left(sel4utils_res_t *node)
+{
+    sel4utils_res_t *right = node->right;
+    node->right = right->left;
+    right->left = node;
+    res_update(node);
+    res_update(right);
+    return right;
+}
 
-    /* insert at head */
-    if (data->reservation_head == NULL || reservation->start > data->reservation_head->start) {
-        reservation->next = data->reservation_head;
-        data->reservation_head = reservation;
-        return;
-    }
+/* restore the AVL property at node, returns the new root of the subtree */
+static sel4utils_res_t *
+res_balance(sel4utils_res_t *node)
+{
+    res_update(node);
+    int balance = res_height(node->left) - res_height(node->right);
 
-    /* insert elsewhere */
-    sel4utils_res_t *prev = data->reservation_head;
-    sel4utils_res_t *current = prev->next;
+    if (balance > 1) {
+        if (res_height(node->left->left) < res_height(node->left->right)) {
+            node->left = res_rotate_left(node->left);
+        }
+        return res_rotate_right(node);
+    }
 
-    while (current != NULL) {
-        /* insert in the middle */
-        if (reservation->start > current->start) {
-            reservation->next = current;
-            prev->next = reservation;
-            return;
+    if (balance < -1) {
+        if (res_height(node->right->right) < res_height(node->right->left)) {
+            node->right = res_rotate_right(node->right);
         }
-        prev = current;
-        current = current->next;
+        return res_rotate_left(node);
     }
 
-    /* insert at the end */
-    prev->next = reservation;
+    return node;
 }
 
-static void
-remove_reservation(sel4utils_alloc_data_t *data, sel4utils_res_t *reservation)
+/* total order on reservations: by start address, then by address of the struct so
+ * empty reservations that share a start address can still be told apart */
+static inline int
+res_less(sel4utils_res_t *a, sel4utils_res_t *b)
 {
-    /* remove head */
-    if (reservation == data->reservation_head) {
-        data->reservation_head = data->reservation_head->next;
-        reservation->next = NULL;
-        return;
+    return a->start < b->start || (a->start == b->start && a < b);
+}
+
+static sel4utils_res_t *
+res_tree_insert(sel4utils_res_t *root, sel4utils_res_t *reservation)
+{
+    if (root == NULL) {
+        return reservation;
     }
 
-    sel4utils_res_t *prev = data->reservation_head;
-    sel4utils_res_t *current = prev->next;
+    if (res_less(reservation, root)) {
+        root->left = res_tree_insert(root->left, reservation);
+    } else {
+        root->right = res_tree_insert(root->right, reservation);
+    }
 
-    while (current != NULL) {
-        /* remove middle */
-        if (current == reservation) {
-            prev->next = reservation->next;
-            reservation->next = NULL;
-            return;
+    return res_balance(root);
+}
+
+/* unlink the smallest node of a subtree, which is returned in min */
+static sel4utils_res_t *
+res_tree_remove_min(sel4utils_res_t *root, sel4utils_res_t **min)
+{
+    if (root->left == NULL) {
+        *min = root;
+        return root->right;
+    }
+
+    root->left = res_tree_remove_min(root->left, min);
+    return res_balance(root);
+}
+
+static sel4utils_res_t *
+res_tree_remove(sel4utils_res_t *root, sel4utils_res_t *reservation)
+{
+    if (root == NULL) {
+        /* not in the tree */
+        return NULL;
+    }
+
+    if (root != reservation) {
+        if (res_less(reservation, root)) {
+            root->left = res_tree_remove(root->left, reservation);
+        } else {
+            root->right = res_tree_remove(root->right, reservation);
         }
-        prev = current;
-        current = current->next;
+        return res_balance(root);
     }
 
-    /* remove tail */
-    prev->next = NULL;
-    reservation->next = NULL;
+    /* found it, replace it with its successor */
+    if (root->right == NULL) {
+        return root->left;
+    }
+
+    sel4utils_res_t *successor;
+    sel4utils_res_t *right = res_tree_remove_min(root->right, &successor);
+    successor->left = root->left;
+    successor->right = right;
+    return res_balance(successor);
+}
+
+static void
+insert_reservation(sel4utils_alloc_data_t *data, sel4utils_res_t *reservation)
+{
+
+    assert(data != NULL);
+    assert(reservation != NULL);
+
+    reservation->left = NULL;
+    reservation->right = NULL;
+    reservation->max_end = reservation->end;
+    reservation->height = 1;
+
+    data->reservation_root = res_tree_insert(data->reservation_root, reservation);
+}
+
+static void
+remove_reservation(sel4utils_alloc_data_t *data, sel4utils_res_t *reservation)
+{
+    data->reservation_root = res_tree_remove(data->reservation_root, reservation);
+    reservation->left = NULL;
+    reservation->right = NULL;
 }
 
 static void
@@ -191,6 +345,10 @@ perform_reservation(vspace_t *vspace, sel4utils_res_t *reservation, void *vaddr,
 
     reservation->rights = rights;
     reservation->cacheable = cacheable;
+    reservation->lazy = 0;
+    reservation->source_vspace = NULL;
+    reservation->cow = 0;
+    reservation->executable = 0;
 
     int error = seL4_NoError;
     void *v = reservation->start;
@@ -297,14 +455,19 @@ static sel4utils_res_t *
 find_reserve(sel4utils_alloc_data_t *data, void *vaddr)
 {
 
-    sel4utils_res_t *current = data->reservation_head;
+    sel4utils_res_t *current = data->reservation_root;
 
+    /* standard interval tree search: only descend left if something there ends after vaddr */
     while (current != NULL) {
         if (vaddr >= current->start && vaddr < current->end) {
             return current;
         }
 
-        current = current->next;
+        if (current->left != NULL && current->left->max_end > vaddr) {
+            current = current->left;
+        } else {
+            current = current->right;
+        }
     }
 
     return NULL;
@@ -312,37 +475,80 @@ find_reserve(sel4utils_alloc_data_t *data, void *vaddr)
 
 
 
+/* work out where the search should continue after skipping from the bottom level
+ * containing vaddr to the bottom level next_level, without walking off the end of the
+ * available address space */
+static uintptr_t
+skip_levels(uintptr_t vaddr, uint32_t level, uint32_t next_level)
+{
+    uint64_t next = (uint64_t) ROUND_DOWN(vaddr, BYTES_PER_LEVEL) +
+                    (uint64_t) (next_level - level) * BYTES_PER_LEVEL;
+
+    return (uintptr_t) MIN(next, (uint64_t) KERNEL_RESERVED_START);
+}
+
+/* find num_4k_pages of free virtual memory starting at an address aligned to BIT(size_bits) */
 static void *
-find_range(sel4utils_alloc_data_t *data, size_t num_pages, size_t size_bits)
+find_range_aligned(sel4utils_alloc_data_t *data, size_t num_4k_pages, size_t size_bits)
 {
     /* look for a contiguous range that is free.
      * We use first-fit with the optimisation that we store
-     * a pointer to the last thing we freed/allocated */
-    int num_4k_pages = BYTES_TO_4K_PAGES(num_pages * (1 << size_bits));
-    void *current = data->last_allocated;
+     * a pointer to the last thing we freed/allocated.
+     * The free index lets us step over bottom levels that are entirely
+     * empty or entirely used without looking at each of their entries */
+    sel4utils_free_index_t *index = &data->free_index;
+    uintptr_t current = ROUND_UP((uintptr_t) data->last_allocated, BIT(size_bits));
+    uintptr_t start = current;
     size_t contiguous = 0;
-    void *start = data->last_allocated;
-    while (contiguous < num_4k_pages) {
 
-        if (is_available(data->top_level, current) && IS_ALIGNED((uint32_t)((seL4_Word)start), size_bits)) {
-            contiguous++;
-        } else {
-            start = current + PAGE_SIZE_4K;
-            contiguous = 0;
-        }
-
-        current += PAGE_SIZE_4K;
+    while (contiguous < num_4k_pages) {
 
-        if (current >= (void *) KERNEL_RESERVED_START) {
+        if (current >= KERNEL_RESERVED_START) {
             LOG_ERROR("Out of virtual memory");
             return NULL;
         }
 
+        uint32_t level = TOP_LEVEL_INDEX(current);
+
+        if (data->top_level[level] == (void *) RESERVED || index->used[level] == VSPACE_LEVEL_SIZE) {
+            /* nothing free in this level, restart the search at the next level that has space */
+            uint32_t next_level = free_index_next(index->has_free, index->has_free_summary, level + 1);
+            current = ROUND_UP(skip_levels(current, level, next_level), BIT(size_bits));
+            start = current;
+            contiguous = 0;
+        } else if (index->used[level] == 0) {
+            /* the rest of this level is free, as are any empty levels directly after it */
+            uint32_t next_level = free_index_next(index->has_used, index->has_used_summary, level + 1);
+            uintptr_t end = skip_levels(current, level, next_level);
+            size_t pages = (end - current) / PAGE_SIZE_4K;
+
+            if (pages >= num_4k_pages - contiguous) {
+                current += (num_4k_pages - contiguous) * PAGE_SIZE_4K;
+                contiguous = num_4k_pages;
+            } else {
+                contiguous += pages;
+                current = end;
+            }
+        } else if (is_available(data->top_level, (void *) current)) {
+            /* partially used level, check entries individually */
+            contiguous++;
+            current += PAGE_SIZE_4K;
+        } else {
+            current = ROUND_UP(current + PAGE_SIZE_4K, BIT(size_bits));
+            start = current;
+            contiguous = 0;
+        }
     }
 
-    data->last_allocated = current;
+    data->last_allocated = (void *) current;
+
+    return (void *) start;
+}
 
-    return start;
+static void *
+find_range(sel4utils_alloc_data_t *data, size_t num_pages, size_t size_bits)
+{
+    return find_range_aligned(data, BYTES_TO_4K_PAGES(num_pages * (1 << size_bits)), size_bits);
 }
 
 static int
@@ -365,21 +571,204 @@ map_pages_at_vaddr(vspace_t *vspace, seL4_CPtr caps[], uint32_t cookies[],
     return error;
 }
 
+static inline sel4utils_frame_batch_t **
+frame_batch_bucket(sel4utils_alloc_data_t *data, uint32_t cookie)
+{
+    /* cookies are often aligned addresses, so mix the high bits in */
+    return &data->frame_batches[(cookie * 2654435761u) >> (32 - SEL4UTILS_FRAME_BATCH_BUCKET_BITS)];
+}
+
+static sel4utils_frame_batch_t *
+find_frame_batch(sel4utils_alloc_data_t *data, uint32_t cookie, sel4utils_frame_batch_t ***prev)
+{
+    sel4utils_frame_batch_t **current = frame_batch_bucket(data, cookie);
+
+    while (*current != NULL && (*current)->untyped.ut != cookie) {
+        current = &(*current)->next;
+    }
+
+    if (prev != NULL) {
+        *prev = current;
+    }
+    return *current;
+}
+
+/* give back the memory behind a frame, which either has its own untyped or is part of a batch */
+static void
+free_frame_memory(sel4utils_alloc_data_t *data, vka_t *vka, size_t size_bits, uint32_t cookie)
+{
+    sel4utils_frame_batch_t **prev;
+    sel4utils_frame_batch_t *batch = find_frame_batch(data, cookie, &prev);
+
+    if (batch == NULL) {
+        vka_utspace_free(vka, kobject_get_type(KOBJECT_FRAME, size_bits), size_bits, cookie);
+        return;
+    }
+
+    assert(batch->frames > 0);
+    batch->frames--;
+    if (batch->frames == 0) {
+        *prev = batch->next;
+        vka_free_object(vka, &batch->untyped);
+        free(batch);
+    }
+}
+
+/*
+ * Allocate and map up to num_pages frames out of a single untyped, retyping as many frames
+ * as the cslot allocator hands out contiguous slots for in one invocation.
+ *
+ * @return the number of frames mapped, 0 if no suitable untyped could be allocated, or -1 on
+ *         failure in which case nothing is left mapped.
+ */
+static int
+new_pages_batch(vspace_t *vspace, void *vaddr, size_t num_pages, size_t size_bits,
+                seL4_CapRights rights, int cacheable)
+{
+    sel4utils_alloc_data_t *data = get_alloc_data(vspace);
+    seL4_Word type = kobject_get_type(KOBJECT_FRAME, size_bits);
+    void *start_vaddr = vaddr;
+
+    sel4utils_frame_batch_t *batch = (sel4utils_frame_batch_t *) malloc(sizeof(sel4utils_frame_batch_t));
+    if (batch == NULL) {
+        return 0;
+    }
+
+    /* find the biggest power of 2 worth of frames we can get an untyped for */
+    size_t n;
+    for (n = BIT(31 - CLZ((uint32_t) num_pages)); n >= CONFIG_SEL4UTILS_NEW_PAGES_BATCH; n /= 2) {
+        if (vka_alloc_untyped(data->vka, size_bits + CTZ(n), &batch->untyped) == 0) {
+            break;
+        }
+    }
+
+    if (n < CONFIG_SEL4UTILS_NEW_PAGES_BATCH) {
+        free(batch);
+        return 0;
+    }
+
+    batch->frame_bits = size_bits;
+    batch->frames = 0;
+    sel4utils_frame_batch_t **bucket = frame_batch_bucket(data, batch->untyped.ut);
+    batch->next = *bucket;
+    *bucket = batch;
+
+    size_t done = 0;
+    seL4_CPtr slot;
+    int error = vka_cspace_alloc(data->vka, &slot);
+
+    while (error == seL4_NoError && done < n) {
+        cspacepath_t run;
+        seL4_CPtr first = slot;
+        size_t run_len = 1;
+
+        vka_cspace_make_path(data->vka, first, &run);
+        slot = 0;
+
+        /* grow the run for as long as the allocator hands out adjacent slots */
+        while (done + run_len < n) {
+            cspacepath_t path;
+            if (vka_cspace_alloc(data->vka, &slot) != 0) {
+                slot = 0;
+                break;
+            }
+            vka_cspace_make_path(data->vka, slot, &path);
+            if (slot != first + run_len || path.root != run.root || path.dest != run.dest ||
+                    path.destDepth != run.destDepth || path.offset != run.offset + run_len) {
+                /* this slot starts the next run */
+                break;
+            }
+            slot = 0;
+            run_len++;
+        }
+
+        error = seL4_Untyped_Retype(batch->untyped.cptr, type, size_bits, run.root, run.dest,
+                                    run.destDepth, run.offset, run_len);
+        if (error != seL4_NoError) {
+            LOG_ERROR("Failed to retype "DFMT" frames, error %d", run_len, error);
+            for (size_t i = 0; i < run_len; i++) {
+                vka_cspace_free(data->vka, first + i);
+            }
+            break;
+        }
+
+        for (size_t i = 0; i < run_len; i++) {
+            if (error == seL4_NoError) {
+                error = map_page(vspace, first + i, vaddr, rights, cacheable, size_bits);
+            }
+            if (error == seL4_NoError) {
+                error = update_entries(vspace, vaddr, first + i, size_bits, batch->untyped.ut);
+            }
+
+            if (error == seL4_NoError) {
+                batch->frames++;
+                vaddr += BIT(size_bits);
+            } else {
+                /* this frame was never recorded, so nobody else will clean it up */
+                cspacepath_t path;
+                vka_cspace_make_path(data->vka, first + i, &path);
+                vka_cnode_delete(&path);
+                vka_cspace_free(data->vka, first + i);
+            }
+        }
+
+        done += run_len;
+        if (error == seL4_NoError && done < n && slot == 0) {
+            error = vka_cspace_alloc(data->vka, &slot);
+        }
+    }
+
+    if (slot != 0) {
+        vka_cspace_free(data->vka, slot);
+    }
+
+    if (error == seL4_NoError) {
+        return done;
+    }
+
+    LOG_ERROR("Failed to allocate batch of "DFMT" pages", n);
+    if (batch->frames > 0) {
+        /* unmapping the last frame of the batch releases the untyped */
+        sel4utils_unmap_pages(vspace, start_vaddr, batch->frames, size_bits, data->vka);
+    } else {
+        *bucket = batch->next;
+        vka_free_object(data->vka, &batch->untyped);
+        free(batch);
+    }
+    return -1;
+}
+
 static int
 new_pages_at_vaddr(vspace_t *vspace, void *vaddr, size_t num_pages, size_t size_bits,
                    seL4_CapRights rights, int cacheable)
 {
 
     sel4utils_alloc_data_t *data = get_alloc_data(vspace);
-    int i;
+    size_t i;
     int error = seL4_NoError;
     void *start_vaddr = vaddr;
+    int try_batch = CONFIG_SEL4UTILS_NEW_PAGES_BATCH > 0;
+
+    for (i = 0; i < num_pages;) {
+        if (try_batch && num_pages - i >= CONFIG_SEL4UTILS_NEW_PAGES_BATCH) {
+            int batched = new_pages_batch(vspace, vaddr, num_pages - i, size_bits, rights, cacheable);
+            if (batched < 0) {
+                error = -1;
+                break;
+            } else if (batched > 0) {
+                i += batched;
+                vaddr += batched * BIT(size_bits);
+                continue;
+            }
+            /* no untyped big enough, stop trying and allocate frames one at a time */
+            try_batch = 0;
+        }
 
-    for (i = 0; i < num_pages; i++) {
         vka_object_t object;
         if (vka_alloc_frame(data->vka, size_bits, &object) != 0) {
             /* abort! */
             LOG_ERROR("Failed to allocate page");
+            error = -1;
             break;
         }
 
@@ -388,6 +777,7 @@ new_pages_at_vaddr(vspace_t *vspace, void *vaddr, size_t num_pages, size_t size_
         if (error == seL4_NoError) {
             error = update_entries(vspace, vaddr, object.cptr, size_bits, object.ut);
             vaddr += (1 << size_bits);
+            i++;
         } else {
             vka_free_object(data->vka, &object);
             break;
@@ -416,8 +806,11 @@ sel4utils_map_pages_at_vaddr(vspace_t *vspace, seL4_CPtr caps[], uint32_t cookie
         return -1;
     }
 
+    /* frames given to a copy on write reservation are shared, so never writable */
+    seL4_CapRights rights = res->cow ? (res->rights & ~seL4_CanWrite) : res->rights;
+
     return map_pages_at_vaddr(vspace, caps, cookies, vaddr, num_pages, size_bits,
-                              res->rights, res->cacheable);
+                              rights, res->cacheable);
 }
 
 seL4_CPtr
@@ -485,8 +878,7 @@ sel4utils_unmap_pages(vspace_t *vspace, void *vaddr, size_t num_pages, size_t si
             vka_cspace_make_path(vka, cap, &path);
             vka_cnode_delete(&path);
             vka_cspace_free(vka, cap);
-            vka_utspace_free(vka, kobject_get_type(KOBJECT_FRAME, size_bits),
-                             size_bits, sel4utils_get_cookie(vspace, vaddr));
+            free_frame_memory(data, vka, size_bits, sel4utils_get_cookie(vspace, vaddr));
         }
 
         if (reserve == NULL) {
@@ -534,6 +926,111 @@ sel4utils_new_pages(vspace_t *vspace, seL4_CapRights rights, size_t num_pages,
 }
 
 
+void *
+sel4utils_new_pages_auto(vspace_t *vspace, seL4_CapRights rights, size_t bytes)
+{
+    sel4utils_alloc_data_t *data = get_alloc_data(vspace);
+    /* frames are allocated in runs of one size, and the size only ever goes down */
+    struct {
+        void *vaddr;
+        size_t num_pages;
+        size_t size_bits;
+    } runs[NUM_SEL4_PAGE_SIZES];
+    int num_runs = 0;
+
+    bytes = ROUND_UP(bytes, PAGE_SIZE_4K);
+    if (bytes == 0) {
+        return NULL;
+    }
+
+    /* align the whole range to the largest page size that fits in it */
+    int size = NUM_SEL4_PAGE_SIZES - 1;
+    while (size > 0 && BIT(sel4_supported_page_sizes[size]) > bytes) {
+        size--;
+    }
+
+    void *vaddr = find_range_aligned(data, BYTES_TO_4K_PAGES(bytes), sel4_supported_page_sizes[size]);
+    if (vaddr == NULL) {
+        return NULL;
+    }
+
+    void *current = vaddr;
+    void *end = vaddr + bytes;
+
+    while (current < end) {
+        /* use the largest frames that are aligned and fit in what is left */
+        while (size > 0 && (BIT(sel4_supported_page_sizes[size]) > (uintptr_t) (end - current) ||
+                            !IS_ALIGNED((uintptr_t) current, sel4_supported_page_sizes[size]))) {
+            size--;
+        }
+
+        size_t size_bits = sel4_supported_page_sizes[size];
+        size_t num_pages = (uintptr_t) (end - current) >> size_bits;
+
+        if (new_pages_at_vaddr(vspace, current, num_pages, size_bits, rights, 1) == seL4_NoError) {
+            runs[num_runs].vaddr = current;
+            runs[num_runs].num_pages = num_pages;
+            runs[num_runs].size_bits = size_bits;
+            num_runs++;
+            current += num_pages * BIT(size_bits);
+        } else if (size > 0) {
+            /* could not get frames this big, fall back to the next size down */
+            size--;
+        } else {
+            LOG_ERROR("Failed to allocate "DFMT" bytes of pages", bytes);
+            for (int i = 0; i < num_runs; i++) {
+                sel4utils_unmap_pages(vspace, runs[i].vaddr, runs[i].num_pages, runs[i].size_bits,
+                                      data->vka);
+            }
+            return NULL;
+        }
+    }
+
+    return vaddr;
+}
+
+/* work out the size of the frame mapped at vaddr from the book keeping */
+static size_t
+mapped_frame_bits(sel4utils_alloc_data_t *data, void *vaddr)
+{
+    bottom_level_t *level = data->top_level[TOP_LEVEL_INDEX(vaddr)];
+
+    if (is_large_level(level)) {
+        return to_large_level(level)->size_bits;
+    }
+
+    /* every 4K entry of a frame holds the frame's cap, and a frame cap can only be
+     * mapped once, so the run of identical caps is exactly the frame */
+    seL4_CPtr cap = get_cap(data->top_level, vaddr);
+    uint32_t pages = 1;
+    while (pages < BIT(sel4_supported_page_sizes[NUM_SEL4_PAGE_SIZES - 1] - PAGE_BITS_4K) &&
+            (uintptr_t) vaddr + pages * PAGE_SIZE_4K < KERNEL_RESERVED_START &&
+            get_cap(data->top_level, vaddr + pages * PAGE_SIZE_4K) == cap) {
+        pages++;
+    }
+
+    return PAGE_BITS_4K + CTZ(pages);
+}
+
+void
+sel4utils_unmap_pages_auto(vspace_t *vspace, void *vaddr, size_t bytes, vka_t *vka)
+{
+    sel4utils_alloc_data_t *data = get_alloc_data(vspace);
+    void *end = vaddr + ROUND_UP(bytes, PAGE_SIZE_4K);
+
+    while (vaddr < end) {
+        if (sel4utils_get_cap(vspace, vaddr) == 0) {
+            vaddr += PAGE_SIZE_4K;
+            continue;
+        }
+
+        size_t size_bits = mapped_frame_bits(data, vaddr);
+        sel4utils_unmap_pages(vspace, vaddr, 1, size_bits, vka);
+        vaddr += BIT(size_bits);
+    }
+}
+
+
 int sel4utils_reserve_range_no_alloc(vspace_t *vspace, sel4utils_res_t *reservation, size_t size,
                                      seL4_CapRights rights, int cacheable, void **result)
 {
@@ -575,6 +1072,266 @@ sel4utils_reserve_range(vspace_t *vspace, size_t size, seL4_CapRights rights,
     return reservation;
 }
 
+reservation_t
+sel4utils_reserve_range_lazy(vspace_t *vspace, size_t bytes, seL4_CapRights rights,
+                             int cacheable, void **vaddr)
+{
+    reservation_t reservation = sel4utils_reserve_range(vspace, bytes, rights, cacheable, vaddr);
+
+    if (reservation.res != NULL) {
+        reservation_to_res(reservation)->lazy = 1;
+    }
+
+    return reservation;
+}
+
+reservation_t
+sel4utils_reserve_range_at_lazy(vspace_t *vspace, void *vaddr, size_t bytes,
+                                seL4_CapRights rights, int cacheable)
+{
+    reservation_t reservation = sel4utils_reserve_range_at(vspace, vaddr, bytes, rights, cacheable);
+
+    if (reservation.res != NULL) {
+        reservation_to_res(reservation)->lazy = 1;
+    }
+
+    return reservation;
+}
+
+int
+sel4utils_fill_window_create(sel4utils_fill_window_t *window, vka_t *vka, vspace_t *vspace)
+{
+    memset(window, 0, sizeof(*window));
+    window->vspace = vspace;
+    window->vka = vka;
+    window->page_directory = get_alloc_data(vspace)->page_directory;
+
+    window->reservation = vspace_reserve_range(vspace, SEL4UTILS_FILL_WINDOW_PAGES * PAGE_SIZE_4K,
+                                               seL4_AllRights, 1, &window->vaddr);
+    if (window->reservation.res == NULL) {
+        LOG_ERROR("Failed to reserve fill window");
+        return -1;
+    }
+
+    /* with the page table in place, filling a page never needs the vspace */
+    int error = sel4utils_prepare_range(vspace, window->vaddr, SEL4UTILS_FILL_WINDOW_PAGES * PAGE_SIZE_4K);
+    for (int i = 0; i < SEL4UTILS_FILL_WINDOW_PAGES && !error; i++) {
+        error = vka_cspace_alloc(vka, &window->slots[i]);
+    }
+    if (error) {
+        LOG_ERROR("Failed to set up fill window");
+        sel4utils_fill_window_destroy(window);
+        return -1;
+    }
+
+    return 0;
+}
+
+void
+sel4utils_fill_window_destroy(sel4utils_fill_window_t *window)
+{
+    for (int i = 0; i < SEL4UTILS_FILL_WINDOW_PAGES; i++) {
+        if (window->slots[i] != 0) {
+            vka_cspace_free(window->vka, window->slots[i]);
+        }
+    }
+    if (window->reservation.res != NULL) {
+        vspace_free_reservation(window->vspace, window->reservation);
+    }
+    memset(window, 0, sizeof(*window));
+}
+
+/* map a copy of the frame cap at page i of the window */
+static void *
+window_map(sel4utils_fill_window_t *window, int i, vka_t *vka, seL4_CPtr frame)
+{
+    cspacepath_t src_path, dest_path;
+
+    vka_cspace_make_path(vka, frame, &src_path);
+    vka_cspace_make_path(window->vka, window->slots[i], &dest_path);
+    if (vka_cnode_copy(&dest_path, &src_path, seL4_AllRights) != seL4_NoError) {
+        return NULL;
+    }
+
+    void *vaddr = window->vaddr + i * PAGE_SIZE_4K;
+    int error = seL4_ARCH_Page_Map(window->slots[i], window->page_directory, (seL4_Word) vaddr,
+                                   seL4_AllRights, seL4_ARCH_Default_VMAttributes);
+    if (error != seL4_NoError) {
+        vka_cnode_delete(&dest_path);
+        return NULL;
+    }
+
+    return vaddr;
+}
+
+static void
+window_unmap(sel4utils_fill_window_t *window, int i)
+{
+    cspacepath_t path;
+
+    seL4_ARCH_Page_Unmap(window->slots[i]);
+    vka_cspace_make_path(window->vka, window->slots[i], &path);
+    vka_cnode_delete(&path);
+}
+
+/* copy len bytes from src into the frame cap through window, starting offset bytes in */
+static int
+fill_frame(sel4utils_fill_window_t *window, vka_t *vka, seL4_CPtr frame, size_t offset,
+           const void *src, size_t len)
+{
+    void *dst = window_map(window, 0, vka, frame);
+    if (dst == NULL) {
+        return -1;
+    }
+
+    memcpy(dst + offset, src, len);
+    window_unmap(window, 0);
+
+    return 0;
+}
+
+int
+sel4utils_handle_lazy_fault(vspace_t *vspace, sel4utils_fill_window_t *window, void *vaddr)
+{
+    sel4utils_alloc_data_t *data = get_alloc_data(vspace);
+    void *page = (void *) PAGE_ALIGN_4K((seL4_Word) vaddr);
+    sel4utils_res_t *res = find_reserve(data, page);
+
+    /* anything else is a real fault */
+    if (res == NULL || !res->lazy || !is_reserved(data->top_level, page)) {
+        return -1;
+    }
+
+    int error = new_pages_at_vaddr(vspace, page, 1, seL4_PageBits, res->rights, res->cacheable);
+    if (error || res->source_vspace == NULL) {
+        return error;
+    }
+
+    /* new frames are zeroed, so only the part with initial contents needs writing */
+    void *start = MAX(page, res->source_vaddr);
+    void *end = MIN(page + PAGE_SIZE_4K, res->source_vaddr + res->source_size);
+    if (start >= end) {
+        return 0;
+    }
+
+    if (window == NULL || window->vspace != res->source_vspace) {
+        LOG_ERROR("No fill window in the source vspace of lazy page %p", page);
+        error = -1;
+    } else {
+        error = fill_frame(window, data->vka, sel4utils_get_cap(vspace, page), start - page,
+                           res->source + (start - res->source_vaddr), end - start);
+    }
+    if (error) {
+        LOG_ERROR("Failed to fill lazy page %p", page);
+        sel4utils_unmap_pages(vspace, page, 1, seL4_PageBits, data->vka);
+        return error;
+    }
+    if (res->executable) {
+        sel4utils_unify_instruction(vspace, start, end - start);
+    }
+
+    return 0;
+}
+
+int
+sel4utils_set_lazy_source(vspace_t *vspace, reservation_t reservation, vspace_t *source_vspace,
+                          void *vaddr, void *source, size_t size)
+{
+    sel4utils_res_t *res = reservation_to_res(reservation);
+
+    if (!res->lazy || vaddr < res->start || vaddr + size > res->end || vaddr + size < vaddr) {
+        LOG_ERROR("Range %p of %u bytes is not in a lazy reservation", vaddr, (uint32_t) size);
+        return -1;
+    }
+
+    res->source_vspace = source_vspace;
+    res->source = source;
+    res->source_vaddr = vaddr;
+    res->source_size = size;
+
+    return 0;
+}
+
+void
+sel4utils_set_executable(vspace_t *vspace, reservation_t reservation)
+{
+    reservation_to_res(reservation)->executable = 1;
+}
+
+reservation_t
+sel4utils_reserve_range_at_cow(vspace_t *vspace, void *vaddr, size_t bytes,
+                               seL4_CapRights rights, int cacheable)
+{
+    reservation_t reservation = sel4utils_reserve_range_at(vspace, vaddr, bytes, rights, cacheable);
+
+    if (reservation.res != NULL) {
+        reservation_to_res(reservation)->cow = 1;
+    }
+
+    return reservation;
+}
+
+int
+sel4utils_handle_cow_fault(vspace_t *vspace, sel4utils_fill_window_t *window, void *vaddr)
+{
+    sel4utils_alloc_data_t *data = get_alloc_data(vspace);
+    void *page = (void *) PAGE_ALIGN_4K((seL4_Word) vaddr);
+    sel4utils_res_t *res = find_reserve(data, page);
+
+    if (res == NULL || !res->cow) {
+        return -1;
+    }
+
+    /* private copies have a cookie, shared frames do not */
+    seL4_CPtr shared = sel4utils_get_cap(vspace, page);
+    if (shared == 0 || get_cookie(data->top_level, page) != 0) {
+        return -1;
+    }
+
+    vka_object_t object;
+    if (vka_alloc_frame(data->vka, seL4_PageBits, &object) != 0) {
+        LOG_ERROR("Failed to allocate page");
+        return -1;
+    }
+
+    void *src = window_map(window, 0, data->vka, shared);
+    void *dst = src == NULL ? NULL : window_map(window, 1, data->vka, object.cptr);
+    if (dst == NULL) {
+        LOG_ERROR("Failed to map pages to copy");
+        if (src != NULL) {
+            window_unmap(window, 0);
+        }
+        vka_free_object(data->vka, &object);
+        return -1;
+    }
+
+    memcpy(dst, src, PAGE_SIZE_4K);
+#ifdef CONFIG_ARCH_ARM
+    if (res->executable) {
+        seL4_ARM_Page_Unify_Instruction(window->slots[1], 0, PAGE_SIZE_4K);
+    }
+#endif /* CONFIG_ARCH_ARM */
+    window_unmap(window, 0);
+    window_unmap(window, 1);
+
+    /* swap the shared frame for the copy */
+    sel4utils_unmap_pages(vspace, page, 1, seL4_PageBits, VSPACE_PRESERVE);
+
+    cspacepath_t path;
+    vka_cspace_make_path(data->vka, shared, &path);
+    vka_cnode_delete(&path);
+    vka_cspace_free(data->vka, shared);
+
+    int error = map_pages_at_vaddr(vspace, &object.cptr, &object.ut, page, 1, seL4_PageBits,
+                                   res->rights, res->cacheable);
+    if (error) {
+        LOG_ERROR("Failed to map private copy of %p", page);
+        vka_free_object(data->vka, &object);
+    }
+
+    return error;
+}
+
 int sel4utils_reserve_range_at_no_alloc(vspace_t *vspace, sel4utils_res_t *reservation, void *vaddr,
                                         size_t size, seL4_CapRights rights, int cacheable)
 {
@@ -688,23 +1445,123 @@ sel4utils_move_resize_reservation(vspace_t *vspace, reservation_t reservation, v
         }
     }
 
-    char need_reinsert = 0;
-    if (res->start != new_start) {
-        need_reinsert = 1;
-    }
+    /* The tree is ordered by start address and caches end addresses, so take the
+     * reservation out while we change it and put it back afterwards. */
+    remove_reservation(data, res);
 
     res->start = new_start;
     res->end = new_end;
 
-    /* We may need to re-insert the reservation into the list to keep it sorted by start address. */
-    if (need_reinsert) {
-        remove_reservation(data, res);
-        insert_reservation(data, res);
-    }
+    insert_reservation(data, res);
 
     return 0;
 }
 
+#ifdef CONFIG_X86_64
+/* create the page directory covering vaddr, and the page directory pointer table
+ * above it if that is missing as well */
+static int
+prepare_page_directory(vspace_t *vspace, void *vaddr)
+{
+    sel4utils_alloc_data_t *data = get_alloc_data(vspace);
+    vka_object_t pagedir = {0};
+
+    int error = vka_alloc_page_directory(data->vka, &pagedir);
+    if (error) {
+        LOG_ERROR("Page directory allocation failed %d", error);
+        return error;
+    }
+
+    error = seL4_ARCH_PageDirectory_Map(pagedir.cptr, data->page_directory, (seL4_Word) vaddr,
+                                        seL4_ARCH_Default_VMAttributes);
+    if (error == seL4_FailedLookupPDPT) {
+        vka_object_t pdpt = {0};
+        error = vka_alloc_page_directory_pointer_table(data->vka, &pdpt);
+        if (!error) {
+            error = seL4_ARCH_PageDirectoryPointerTable_Map(pdpt.cptr, data->page_directory,
+                                                            (seL4_Word) vaddr,
+                                                            seL4_ARCH_Default_VMAttributes);
+            if (error) {
+                vka_free_object(data->vka, &pdpt);
+            } else {
+                vspace_maybe_call_allocated_object(vspace, pdpt);
+            }
+        }
+
+        if (!error) {
+            error = seL4_ARCH_PageDirectory_Map(pagedir.cptr, data->page_directory,
+                                                (seL4_Word) vaddr, seL4_ARCH_Default_VMAttributes);
+        }
+    }
+
+    if (error) {
+        LOG_ERROR("Page directory mapping failed %d", error);
+        vka_free_object(data->vka, &pagedir);
+    } else {
+        vspace_maybe_call_allocated_object(vspace, pagedir);
+    }
+
+    return error;
+}
+#endif /* CONFIG_X86_64 */
+
+int
+sel4utils_prepare_range(vspace_t *vspace, void *vaddr, size_t bytes)
+{
+    sel4utils_alloc_data_t *data = get_alloc_data(vspace);
+    vka_object_t pagetable = {0};
+    int error = seL4_NoError;
+
+    if (data->map_page != sel4utils_map_page_pd) {
+        LOG_ERROR("Not implemented: sel4utils can only prepare ranges in seL4 page directories");
+        return -1;
+    }
+
+    uintptr_t start = ROUND_DOWN((uintptr_t) vaddr, BIT(SEL4UTILS_PAGE_TABLE_COVERAGE_BITS));
+    uintptr_t end = (uintptr_t) vaddr + bytes;
+
+    for (uintptr_t current = start; current < end && error == seL4_NoError;
+            current += BIT(SEL4UTILS_PAGE_TABLE_COVERAGE_BITS)) {
+        /* a page table we failed to map because one was already there is kept for the
+         * next one, so probing costs a single invocation per page table */
+        if (pagetable.cptr == 0) {
+            error = vka_alloc_page_table(data->vka, &pagetable);
+            if (error) {
+                LOG_ERROR("Page table allocation failed, %d", error);
+                break;
+            }
+        }
+
+        error = seL4_ARCH_PageTable_Map(pagetable.cptr, data->page_directory, (seL4_Word) current,
+                                        seL4_ARCH_Default_VMAttributes);
+#ifdef CONFIG_X86_64
+        if (error == seL4_FailedLookupPD || error == seL4_FailedLookupPDPT) {
+            error = prepare_page_directory(vspace, (void *) current);
+            if (!error) {
+                error = seL4_ARCH_PageTable_Map(pagetable.cptr, data->page_directory,
+                                                (seL4_Word) current, seL4_ARCH_Default_VMAttributes);
+            }
+        }
+#endif /* CONFIG_X86_64 */
+
+        if (error == seL4_NoError) {
+            vspace_maybe_call_allocated_object(vspace, pagetable);
+            pagetable.cptr = 0;
+        } else if (error == seL4_DeleteFirst) {
+            /* there is already a page table (or a large frame) here */
+            error = seL4_NoError;
+        } else {
+            LOG_ERROR("Failed to map page table at %p, error %d", (void *) current, error);
+        }
+    }
+
+    if (pagetable.cptr != 0) {
+        vka_free_object(data->vka, &pagetable);
+    }
+
+    return error;
+}
+
 seL4_CPtr
 sel4utils_get_root(vspace_t *vspace)
 {
@@ -713,6 +1570,30 @@ sel4utils_get_root(vspace_t *vspace)
 }
 
 
+/*
+ * Unmap and free a frame while tearing down. The book keeping for it is about to be thrown
+ * away, so unlike sel4utils_unmap_pages this does not look up or update any of it. Only
+ * our own cap is deleted, copies of it shared with other vspaces stay mapped.
+ */
+static void
+tear_down_frame(sel4utils_alloc_data_t *data, vka_t *vka, seL4_CPtr cap, size_t size_bits,
+                uint32_t cookie)
+{
+    cspacepath_t path;
+
+    int error = seL4_ARCH_Page_Unmap(cap);
+    if (error != seL4_NoError) {
+        LOG_ERROR("Failed to unmap page %x", cap);
+    }
+
+    if (vka) {
+        vka_cspace_make_path(vka, cap, &path);
+        vka_cnode_delete(&path);
+        vka_cspace_free(vka, cap);
+        free_frame_memory(data, vka, size_bits, cookie);
+    }
+}
+
 void
 sel4utils_tear_down(vspace_t *vspace, vka_t *vka)
 {
@@ -728,10 +1609,11 @@ sel4utils_tear_down(vspace_t *vspace, vka_t *vka)
         vka = data->vka;
     }
 
-    /* free all the reservations */
-    while (data->reservation_head != NULL) {
-        sel4utils_res_t *res = data->reservation_head;
-        sel4utils_free_reservation_no_alloc(vspace, res);
+    /* free all the reservations. The entries they reserved are thrown away with the
+     * levels below, so there is no need to clear them one at a time */
+    while (data->reservation_root != NULL) {
+        sel4utils_res_t *res = data->reservation_root;
+        remove_reservation(data, res);
         if (res->malloced) {
             free(res);
         }
@@ -743,21 +1625,45 @@ sel4utils_tear_down(vspace_t *vspace, vka_t *vka)
     uint32_t idx;
 
     for (idx = start; idx < end; idx++) {
+        if (is_large_level(data->top_level[idx])) {
+            /* frames covering whole levels know their own size, unmapping one puts
+             * back the levels it set aside */
+            large_level_t *large = to_large_level(data->top_level[idx]);
+            void *vaddr = (void *) (uintptr_t) (idx << TOP_LEVEL_BITS_OFFSET);
+            if (large->cookie != 0) {
+                sel4utils_unmap_pages(vspace, vaddr, 1, large->size_bits, vka);
+            } else {
+                large_level_release(vspace, vaddr);
+            }
+        }
+
         bottom_level_t *bottom_level = data->top_level[idx];
 
         if (bottom_level != NULL && (uint32_t) bottom_level != RESERVED) {
-            /* free all of the pages in the vspace */
-            for (uint32_t i = 0; i < VSPACE_LEVEL_SIZE; i++) {
-                uint32_t page4k = 1;
+            /* free all of the pages in the vspace, stopping once every used entry is seen */
+            uint32_t remaining = data->free_index.used[idx];
+            uint32_t page4k;
+            for (uint32_t i = 0; i < VSPACE_LEVEL_SIZE && remaining > 0; i += page4k) {
+                seL4_CPtr cap = bottom_level->bottom_level[i];
                 uint32_t cookie = bottom_level->cookies[i];
-                uintptr_t vaddr = (idx << TOP_LEVEL_BITS_OFFSET) | (i << BOTTOM_LEVEL_BITS_OFFSET);
+                page4k = 1;
+                if (cap == 0) {
+                    continue;
+                }
                 /* if the cookie isn't 0 we free the object/frame */
-                if (cookie != 0) {
-                    /* we might be unmapping a large page, figure out how big it
-                     * is by looking for consecutive, identical entries */
-                    for (uint32_t j = i + 1; j < VSPACE_LEVEL_SIZE && bottom_level->cookies[j] == cookie; j++, page4k++);
-                    sel4utils_unmap_pages(vspace, (void*)vaddr, 1, PAGE_BITS_4K * page4k, vka);
+                if (cap != RESERVED && cookie != 0) {
+                    sel4utils_frame_batch_t *batch = find_frame_batch(data, cookie, NULL);
+                    if (batch != NULL) {
+                        /* frames in a batch share a cookie but know their size */
+                        page4k = BIT(batch->frame_bits - PAGE_BITS_4K);
+                    } else {
+                        /* we might be unmapping a large page, figure out how big it
+                         * is by looking for consecutive, identical entries */
+                        for (uint32_t j = i + 1; j < VSPACE_LEVEL_SIZE && bottom_level->cookies[j] == cookie; j++, page4k++);
+                    }
+                    tear_down_frame(data, vka, cap, PAGE_BITS_4K + CTZ(page4k), cookie);
                 }
+                remaining -= MIN(remaining, page4k);
             }
             /* now free the level we were using */
             vspace_unmap_pages(data->bootstrap, bottom_level, PAGES_FOR_BOTTOM_LEVEL, PAGE_BITS_4K,
@@ -765,6 +1671,17 @@ sel4utils_tear_down(vspace_t *vspace, vka_t *vka)
         }
     }
 
+    /* whatever batches are left still have frames that were unmapped, or torn down, with
+     * VSPACE_PRESERVE. Those frames belong to the caller now, and so does the untyped they
+     * were retyped from, see sel4utils_frame_batch_t */
+    for (int i = 0; i < SEL4UTILS_FRAME_BATCH_BUCKETS; i++) {
+        while (data->frame_batches[i] != NULL) {
+            sel4utils_frame_batch_t *batch = data->frame_batches[i];
+            data->frame_batches[i] = batch->next;
+            free(batch);
+        }
+    }
+
     /* now free the top level */
     vspace_unmap_pages(data->bootstrap, data->top_level, 1, PAGE_BITS_4K, VSPACE_FREE);
 